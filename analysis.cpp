@@ -3,10 +3,11 @@
 #include "betree.h"
 #include "dual_tree.h"
 
-void dual_tree_test(const std::vector<int>& data_set)
+void dual_tree_test(const std::vector<int>& data_set, CachePolicy policy)
 {
     auto start = std::chrono::high_resolution_clock::now();
     dual_tree<int, int> dt;
+    dt.set_cache_policy(policy);
     int idx = 0;
     int cnt = 0;
     for(int i: data_set){
@@ -27,11 +28,12 @@ void dual_tree_test(const std::vector<int>& data_set)
     std::cout << "Data Load time For dual tree(us):" << duration.count() << std::endl;
     std::cout << "Sorted tree size: " << dt.sorted_tree_size() << std::endl;
     std::cout << "Unsorted tree size: " << dt.unsorted_tree_size() << std::endl;
+    dt.print_cache_stats();
     dt.fanout();
 
 }
 
-void b_plus_tree_test(const std::vector<int>& data_set)
+void b_plus_tree_test(const std::vector<int>& data_set, CachePolicy policy)
 {
     // init a tree that takes integers for both key and value
     // the first argument is the name of the block manager for the cache (can be anything)
@@ -41,8 +43,9 @@ void b_plus_tree_test(const std::vector<int>& data_set)
     // potentially, the only argument to change would be the last one (4th arg) to increase the memory capacity
 
     auto start = std::chrono::high_resolution_clock::now();
-    BeTree<int,int> tree("manager", "./tree_dat", BeTree_Default_Knobs<int, int>::BLOCK_SIZE,
+    BeTree<int,int> tree("manager", "./tree_dat", BeTree_Default_Knobs<int, int>::TREE_BLOCK_SIZE,
         BeTree_Default_Knobs<int, int>::BLOCKS_IN_MEMORY);
+    tree.setCachePolicy(policy);
 
     int idx = 0;
     for(int i: data_set)
@@ -54,13 +57,23 @@ void b_plus_tree_test(const std::vector<int>& data_set)
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
 
     std::cout << "Data Load time For b plus tree(us):" << duration.count() << std::endl;
+    dual_tree<int, int>::print_tree_cache_stats("B+ Tree", &tree);
 
 }
 int main(int argc, char **argv)
 {
     if(argc < 2)
     {
-        std::cout<< "Usage: ./main <input_file>" << std::endl;
+        std::cout<< "Usage: ./main <input_file> [lru|2q|clock]" << std::endl;
+        return 1;
+    }
+
+    // replacement policy of the buffer pools
+    CachePolicy policy = BeTree_Default_Knobs<int, int>::CACHE_POLICY;
+    if(argc > 2 && !parseCachePolicy(argv[2], policy))
+    {
+        std::cout << "Unknown cache policy " << argv[2] << std::endl;
+        return 1;
     }
 
     // Read the input file
@@ -78,8 +91,8 @@ int main(int argc, char **argv)
 
     dual_tree<int, int>::show_tree_knobs();
 
-    dual_tree_test(data);
+    dual_tree_test(data, policy);
     std::this_thread::sleep_for(std::chrono::seconds(2));
-    b_plus_tree_test(data);
+    b_plus_tree_test(data, policy);
     return 0;
 }
\ No newline at end of file
@@ -9,14 +9,36 @@
 #include <queue>
 #include <chrono>
 #include <memory>
+#include <type_traits>
 
 #include "block_manager.h"
 #include "serializable.h"
+#include "search_kernels.h"
+#include "learned_index.h"
 
 #define BE_MAX(a, b) ((a) < (b) ? (b) : (a))
 
 // #define BETREE_FRIENDS
 
+// how a leaf stores its data pairs: as an array of (key, value) pairs, as
+// an array of keys followed by a parallel array of values, or as the
+// smallest key plus 16-bit deltas from it followed by the values
+// (frame of reference)
+enum LeafLayout
+{
+    LEAF_PAIRS,
+    LEAF_SPLIT,
+    LEAF_FOR,
+};
+
+// how an internal node stores its child keys: sorted, or in Eytzinger order
+// (an implicit binary search tree laid out level by level)
+enum PivotLayout
+{
+    PIVOTS_SORTED,
+    PIVOTS_EYTZINGER,
+};
+
 // Defining all required tuning knobs/sizes for the tree
 template <typename _Key, typename _Value>
 class BeTree_Default_Knobs
@@ -25,20 +47,44 @@ public:
     // Epsilon value
     static constexpr double EPSILON = 0.5;
 
-    // size of every block in Bytes
-    static const int BLOCK_SIZE = 4096;
+    // size of every block in Bytes, the size of a buffer pool frame
+    static const int TREE_BLOCK_SIZE = BLOCK_SIZE_BYTES;
 
     // size of metadata in a node
     static const int METADATA_SIZE = 40;
 
     // leftover data size after deducting space for metadata
-    static const int DATA_SIZE = BLOCK_SIZE - METADATA_SIZE;
+    static const int DATA_SIZE = TREE_BLOCK_SIZE - METADATA_SIZE;
 
     // size of every leaf in Bytes
     static const int LEAF_SIZE = DATA_SIZE;
 
-    // number of data pairs that the tree will hold per leaf
-    static const int NUM_DATA_PAIRS = (LEAF_SIZE - sizeof(int)) / (sizeof(_Key) + sizeof(_Value));
+    // LEAF_SPLIT keeps the keys of a leaf apart from its values, so leaf
+    // searches read only keys. LEAF_FOR stores keys as 16-bit deltas from
+    // the leaf's smallest key, which fits more pairs in a leaf when keys are
+    // dense, as in the sorted tree; it needs integer keys and -DBPLUS
+    // (see Data)
+    static const LeafLayout LEAF_LAYOUT = LEAF_PAIRS;
+
+    // number of data pairs a LEAF_FOR leaf holds: its header keeps the
+    // size, the search flag, the position of the key outside the frame, the
+    // frame's base and that key; one value's width is left for alignment
+    static const int NUM_PACKED_DATA_PAIRS = (LEAF_SIZE - 3 * sizeof(int) - 2 * sizeof(_Key) - sizeof(_Value)) / (sizeof(uint16_t) + sizeof(_Value));
+
+    // number of data pairs that the tree will hold per leaf (after the size
+    // and the search flag of the leaf)
+    static const int NUM_DATA_PAIRS = LEAF_LAYOUT == LEAF_FOR ? NUM_PACKED_DATA_PAIRS : (LEAF_SIZE - 2 * sizeof(int)) / (sizeof(_Key) + sizeof(_Value));
+
+    // leaves of the sorted tree whose keys are all within this many positions
+    // of where interpolation between the first and the last key puts them are
+    // flagged when they are sealed; lookups in them interpolate and search
+    // only that many positions on either side. 0 keeps binary search.
+    static const int INTERPOLATION_ERROR = 16;
+
+    // PIVOTS_EYTZINGER stores the child keys of internal nodes in Eytzinger
+    // order, so that child lookups take one cache miss every few levels of
+    // the search instead of one per level (see searchEytzinger)
+    static const PivotLayout PIVOT_LAYOUT = PIVOTS_SORTED;
 
     // size of a key-value pair unit
     static const int UNIT_SIZE = sizeof(_Key *) + sizeof(_Value *);
@@ -84,6 +130,55 @@ public:
 #endif
 
     static const int BLOCKS_IN_MEMORY = 500000;
+
+    // I/O layer of the block manager. IO_BACKEND_ASYNC overlaps eviction
+    // write-backs with reads and batches prefetches (io_uring, or a thread
+    // pool if the kernel lacks it)
+    static const IOBackendType IO_BACKEND = IO_BACKEND_POSIX;
+
+    // STORAGE_MMAP maps the tree file and lets the kernel page cache replace
+    // the block manager's own cache (BLOCKS_IN_MEMORY is ignored then)
+    static const StorageMode STORAGE_MODE = STORAGE_BUFFERED;
+
+    // back the buffer pool's frames with huge pages (explicitly reserved ones
+    // if there are any, transparent huge pages otherwise)
+    static const bool HUGE_PAGES = false;
+
+    // replacement policy of the buffer pool: CACHE_LRU, CACHE_2Q (resists
+    // scans) or CACHE_CLOCK. Can be changed at runtime with setCachePolicy.
+    static const CachePolicy CACHE_POLICY = CACHE_LRU;
+
+    // clean dirty blocks in a background thread, so that evictions on the
+    // insert and query paths rarely have to write. The writer starts once the
+    // high watermark share of the pool is dirty and stops at the low one.
+    static const bool BACKGROUND_WRITEBACK = false;
+    static constexpr float WRITEBACK_HIGH_WATERMARK = 0.2;
+    static constexpr float WRITEBACK_LOW_WATERMARK = 0.1;
+
+    // share of the buffer pool reserved for internal nodes. Internal nodes are
+    // pinned when they are loaded until this share is used up, so the levels
+    // every operation walks through are not evicted by leaves; leaves get the
+    // rest of the pool. 0 leaves all nodes to the replacement policy.
+    static constexpr float INTERNAL_POOL_FRACTION = 0.1;
+
+    // save the ids of the cached blocks, hottest first, whenever the tree is
+    // flushed, so that warmUpCache can bring them back with sorted reads
+    static const bool WARM_UP_SNAPSHOT = false;
+
+    // share of the blocks whose accesses are sampled to estimate the hit ratio
+    // of other BLOCKS_IN_MEMORY settings (see getPredictedHitRatio); 0 is off
+    static constexpr double MISS_RATIO_SAMPLE_RATE = 0;
+
+    // frames of internal nodes keep direct references to the frames of their
+    // resident children, so point queries descend without pool lookups
+    static const bool POINTER_SWIZZLING = false;
+
+    // point queries on a tree built by appends (the sorted tree) find the
+    // sealed leaves with a piecewise linear model of the key to position
+    // mapping instead of descending from the root, and search only the
+    // LEARNED_INDEX_ERROR positions around the predicted one on either side
+    static const bool LEARNED_INDEX = false;
+    static const int LEARNED_INDEX_ERROR = 32;
 };
 
 // structure that holds all stats for the tree
@@ -125,10 +220,11 @@ struct BeTraits
 #ifdef TIMER
 struct BeTimer
 {
-    unsigned long insert_time = 0;
-    unsigned long point_query_time = 0;
-    unsigned long range_query_time = 0;
-    unsigned long bulk_load_time = 0;
+    // queries of several threads add up concurrently
+    std::atomic<unsigned long> insert_time{0};
+    std::atomic<unsigned long> point_query_time{0};
+    std::atomic<unsigned long> range_query_time{0};
+    std::atomic<unsigned long> bulk_load_time{0};
 };
 #endif
 
@@ -176,25 +272,250 @@ struct Buffer
 };
 
 // Structure that holds the data in the tree leaves
-// size signifies the current number of data pairs in the leaf
+// size signifies the current number of data pairs in the leaf, and
+// interpolate whether lookups interpolate (see BeNode::sealLeaf).
+// The layout is picked by knobs::LEAF_LAYOUT; nodes go through the accessors
+// below, which both layouts provide
 template <typename key_type, typename value_type, typename knobs = BeTree_Default_Knobs<key_type, value_type>,
-          typename compare = std::less<key_type>>
+          typename compare = std::less<key_type>, LeafLayout layout = knobs::LEAF_LAYOUT>
 struct Data
 {
     int size;
+    bool interpolate;
     std::pair<key_type, value_type> data[knobs::NUM_DATA_PAIRS];
 
     Data()
     {
         size = 0;
+        interpolate = false;
+    }
+
+    key_type &keyAt(int i) { return data[i].first; }
+
+    std::pair<key_type, value_type> pairAt(int i) { return data[i]; }
+
+    void setPair(int i, const std::pair<key_type, value_type> &element) { data[i] = element; }
+
+    // checks if the leaf holds [key]
+    bool contains(const key_type &key) { return containsKey(data, size, key); }
+
+    // checks if one of the pairs in [lo, hi) has key [key]
+    bool containsIn(const key_type &key, int lo, int hi) { return containsKey(data + lo, hi - lo, key); }
+
+    // the hooks below only matter for LEAF_FOR, whose leaves cannot store
+    // every key: the given key can be added to the leaf
+    bool fits(const key_type &) { return true; }
+
+    // prepares the leaf for the given key before it is stored with setPair
+    void rebaseFor(const key_type &) {}
+
+    // the leaf has to be split right away, whatever its size
+    bool needsSplit() { return false; }
+
+    // index the leaf has to be split at instead of the usual one, -1 if any
+    int isolatingSplit() { return -1; }
+
+    // drops the pairs from [n] on
+    void truncate(int n) { size = n; }
+};
+
+// leaf data with the keys in one array and the values in a parallel one
+// (LEAF_SPLIT): searches touch half the memory and run the vector kernels
+// over a plain key array
+template <typename key_type, typename value_type, typename knobs, typename compare>
+struct Data<key_type, value_type, knobs, compare, LEAF_SPLIT>
+{
+    int size;
+    bool interpolate;
+    key_type keys[knobs::NUM_DATA_PAIRS];
+    value_type values[knobs::NUM_DATA_PAIRS];
+
+    Data()
+    {
+        size = 0;
+        interpolate = false;
     }
+
+    key_type &keyAt(int i) { return keys[i]; }
+
+    std::pair<key_type, value_type> pairAt(int i) { return std::pair<key_type, value_type>(keys[i], values[i]); }
+
+    void setPair(int i, const std::pair<key_type, value_type> &element)
+    {
+        keys[i] = element.first;
+        values[i] = element.second;
+    }
+
+    bool contains(const key_type &key) { return containsIn(key, 0, size); }
+
+    bool containsIn(const key_type &key, int lo, int hi)
+    {
+        int pos = lo + searchKeys(keys + lo, hi - lo, key);
+        return pos < hi && !(key < keys[pos]);
+    }
+
+    bool fits(const key_type &) { return true; }
+
+    void rebaseFor(const key_type &) {}
+
+    bool needsSplit() { return false; }
+
+    int isolatingSplit() { return -1; }
+
+    void truncate(int n) { size = n; }
 };
 
+// leaf data as a frame of reference (LEAF_FOR): keys are stored as 16-bit
+// deltas from the smallest key of the leaf, values at full width. A leaf
+// takes keys up to MAX_DELTA above its base; since B+ tree leaves get one key
+// at a time, the one key that misses the frame is kept whole in wide_key,
+// below (delta 0) or above (MAX_DELTA) the others, and the leaf is split
+// right away so that the key ends up alone in a leaf (see isolatingSplit).
+// Searches run the vector kernels over the deltas.
+template <typename key_type, typename value_type, typename knobs, typename compare>
+struct Data<key_type, value_type, knobs, compare, LEAF_FOR>
+{
+    static_assert(std::is_integral<key_type>::value, "LEAF_FOR needs integer keys");
+    static_assert(knobs::LEAF_FLUSH_LIMIT == 1, "LEAF_FOR needs leaves that take one key at a time (-DBPLUS)");
+
+    static const unsigned MAX_DELTA = 0xFFFF;
+
+    int size;
+    bool interpolate;
+
+    // 1 + index of the key kept in wide_key, 0 if all keys are in the frame
+    int wide;
+
+    key_type base;
+    key_type wide_key;
+    uint16_t deltas[knobs::NUM_DATA_PAIRS];
+    value_type values[knobs::NUM_DATA_PAIRS];
+
+    Data()
+    {
+        size = 0;
+        interpolate = false;
+        wide = 0;
+    }
+
+    // distance of [key] above [from], which is not larger than [key]; the
+    // difference is taken unsigned so that it cannot overflow
+    static unsigned long long distance(const key_type &from, const key_type &key)
+    {
+        return (unsigned long long)key - (unsigned long long)from;
+    }
+
+    bool inFrame(const key_type &key) { return !(key < base) && distance(base, key) <= MAX_DELTA; }
+
+    key_type keyAt(int i) { return wide == i + 1 ? wide_key : (key_type)(base + deltas[i]); }
+
+    std::pair<key_type, value_type> pairAt(int i) { return std::pair<key_type, value_type>(keyAt(i), values[i]); }
+
+    void setPair(int i, const std::pair<key_type, value_type> &element)
+    {
+        if (inFrame(element.first))
+        {
+            deltas[i] = (uint16_t)distance(base, element.first);
+            if (wide == i + 1)
+                wide = 0;
+        }
+        else
+        {
+            assert(wide == 0 || wide == i + 1);
+            wide = i + 1;
+            wide_key = element.first;
+            deltas[i] = element.first < base ? 0 : MAX_DELTA;
+        }
+        values[i] = element.second;
+    }
+
+    // index of the first key not smaller than [key]
+    int lowerBound(const key_type &key)
+    {
+        // the deltas of the keys in the frame are in [lo, hi)
+        int lo = wide == 1 ? 1 : 0;
+        int hi = wide > 1 ? wide - 1 : size;
+
+        if (key < base)
+            return lo == 1 && wide_key < key ? 1 : 0;
+        if (distance(base, key) > MAX_DELTA)
+            return hi + (hi < size && wide_key < key);
+        return lo + searchKeys(deltas + lo, hi - lo, (uint16_t)distance(base, key));
+    }
+
+    bool contains(const key_type &key)
+    {
+        int pos = lowerBound(key);
+        return pos < size && !(key < keyAt(pos));
+    }
+
+    bool containsIn(const key_type &key, int lo, int hi)
+    {
+        if (wide != 0 || !inFrame(key))
+            return contains(key);
+        int pos = lo + searchKeys(deltas + lo, hi - lo, (uint16_t)distance(base, key));
+        return pos < hi && !(key < keyAt(pos));
+    }
+
+    bool fits(const key_type &key)
+    {
+        if (size == 0 || inFrame(key))
+            return true;
+        return key < base && distance(key, keyAt(size - 1)) <= MAX_DELTA;
+    }
+
+    // moves the base down to [key] if the largest key stays in the frame
+    void rebaseFor(const key_type &key)
+    {
+        if (size == 0)
+        {
+            base = key;
+            wide = 0;
+            return;
+        }
+        if (!(key < base) || !fits(key))
+            return;
+
+        uint16_t shift = (uint16_t)distance(key, base);
+        for (int i = 0; i < size; i++)
+            deltas[i] += shift;
+        base = key;
+    }
+
+    bool needsSplit() { return wide != 0; }
+
+    // splitting there leaves the key outside the frame alone in its leaf
+    int isolatingSplit()
+    {
+        if (wide == 0)
+            return -1;
+        return wide == 1 ? 1 : wide - 1;
+    }
+
+    void truncate(int n)
+    {
+        size = n;
+        if (wide > n)
+            wide = 0;
+        else if (wide == 1 && n == 1)
+        {
+            // only the key outside the frame is left; it becomes the base
+            base = wide_key;
+            deltas[0] = 0;
+            wide = 0;
+        }
+    }
+};
+
+template <typename key_type, typename value_type, typename knobs, typename compare>
+class NodeHandle;
+
 // class that defines the B Epsilon tree Node
 template <typename key_type, typename value_type, typename knobs = BeTree_Default_Knobs<key_type, value_type>,
           typename compare = std::less<key_type>>
 class BeNode : public Serializable
 {
+    static_assert(sizeof(Data<key_type, value_type, knobs, compare>) <= knobs::LEAF_SIZE, "leaf data does not fit in a block");
 
     uint id;
     // boolean flag if leaf
@@ -226,19 +547,27 @@ class BeNode : public Serializable
 
     BlockManager *manager;
 
-public:
-    // opens the node from disk/memory for access
-    void open()
-    {
+    // number of NodeHandles on the node and the frame they keep in use. While
+    // the node is held its fields stay in place, so open() has nothing to do.
+    int holds;
+    Node *held_frame;
 
-        bool miss = false;
-        Deserialize(manager->internal_memory[manager->OpenBlock(id, miss)]);
+    // counts an open of the node as a cache hit or miss
+    void noteAccess(bool miss)
+    {
+        manager->recordAccess(id, *is_leaf);
         if (miss)
         {
             if (*is_leaf)
                 manager->addLeafCacheMisses();
             else
+            {
                 manager->addInternalCacheMisses();
+
+                // internal nodes stay in memory once loaded, as long as the
+                // pool's internal node quota lasts
+                manager->pinBlock(id);
+            }
         }
         else
         {
@@ -251,8 +580,67 @@ public:
         }
     }
 
+public:
+    // opens the node from disk/memory for access
+    void open()
+    {
+        if (holds > 0)
+            return;
+
+        bool miss = false;
+        Deserialize(*manager->getBlock(id, miss));
+        noteAccess(miss);
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: opens the node once and keeps its frame in use until the
+     *  matching unhold(), independent of the pin scope. Meanwhile the node's
+     *  methods use its fields without looking the block up again. Use
+     *  NodeHandle rather than calling this directly.
+     */
+    void hold()
+    {
+        if (holds++ > 0)
+            return;
+
+        bool miss = false;
+        Deserialize(*manager->acquireBlock(id, miss, held_frame));
+        noteAccess(miss);
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: like hold(), for the child in [slot] of the held node
+     *  [parent]: the node moves to that child and is held. With pointer
+     *  swizzling, the parent's frame leads straight to the child's frame if
+     *  it is resident (see BlockManager::acquireChild).
+     */
+    void holdChild(BeNode &parent, int slot)
+    {
+        assert(holds == 0 && parent.holds > 0);
+        id = parent.pivot_pointers[slot];
+        holds = 1;
+
+        bool miss = false;
+        Deserialize(*manager->acquireChild(parent.held_frame, slot, id, miss, held_frame));
+        noteAccess(miss);
+    }
+
+    void unhold()
+    {
+        assert(holds > 0);
+        if (--holds > 0)
+            return;
+
+        manager->releaseBlock(held_frame);
+        held_frame = nullptr;
+    }
+
     void setToId(uint _id)
     {
+        // a held node cannot move to another block
+        assert(holds == 0);
         id = _id;
         open();
     }
@@ -268,6 +656,8 @@ public:
 
         manager = _manager;
         id = _id;
+        holds = 0;
+        held_frame = nullptr;
         parent = nullptr;
         is_leaf = nullptr;
         is_root = nullptr;
@@ -284,6 +674,11 @@ public:
         *is_leaf = _is_leaf;
         *is_root = _is_root;
         *next_node = _next_node;
+
+        if (_is_leaf)
+            manager->unpinBlock(id);
+        else
+            manager->pinBlock(id);
     }
 
     // constructor used when we know that the node exists in disk
@@ -296,6 +691,8 @@ public:
     {
         manager = _manager;
         id = _id;
+        holds = 0;
+        held_frame = nullptr;
         parent = nullptr;
         is_leaf = nullptr;
         is_root = nullptr;
@@ -311,6 +708,7 @@ public:
 
     ~BeNode()
     {
+        assert(holds == 0);
     }
 
 public:
@@ -331,6 +729,12 @@ public:
         open();
         *is_leaf = _is_leaf;
         manager->addDirtyNode(id);
+
+        // only internal nodes are pinned
+        if (_is_leaf)
+            manager->unpinBlock(id);
+        else
+            manager->pinBlock(id);
     }
 
     void setRoot(bool _is_root)
@@ -369,33 +773,40 @@ public:
     uint slotOfKey(key_type key)
     {
         // make sure that the caller is an internal node
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         assert(!*is_leaf);
 
         // we have k pointers and k+1 pivots
         // where the first pivot will be for any key
         // X<= pointer[0] and last pivot will be for
-        // any key X > pointer[k-1] (this will be pivot[k])
-
-        uint pos;
-        bool flag = false;
-        uint lo = 0, hi = getPivotsCtr() - 1;
+        // any key X > pointer[k-1] (this will be pivot[k]).
+        // The first pivot with key <= pivot is found with the vector kernel
+        // for the key type (see search_kernels.h)
+        if (knobs::PIVOT_LAYOUT == PIVOTS_EYTZINGER)
+            return searchEytzinger(child_key_values, getPivotsCtr() - 1, key);
+        return searchKeys(child_key_values, getPivotsCtr() - 1, key);
+    }
 
-        while (lo < hi)
-        {
-            int mid = (lo + hi) >> 1;
+    // index in child_key_values of the child key in [slot], in sorted order
+    int childKeyIndex(int slot)
+    {
+        int num_keys = getPivotsCtr() - 1;
+        if (knobs::PIVOT_LAYOUT == PIVOTS_SORTED || slot >= num_keys)
+            return slot;
+        return eytzingerIndex(slot, num_keys);
+    }
 
-            if (key <= child_key_values[mid])
-            {
-                hi = mid; // key <= mid
-            }
-            else
-            {
-                lo = mid + 1; // key > mid
-            }
-        }
+    // copies the child keys into [sorted] in sorted order
+    void readChildKeys(key_type *sorted)
+    {
+        fromEytzinger(child_key_values, sorted, getPivotsCtr() - 1);
+    }
 
-        return lo;
+    // stores the sorted child keys [sorted] in the node's layout, for the
+    // current pivot counter
+    void writeChildKeys(const key_type *sorted)
+    {
+        toEytzinger(sorted, child_key_values, getPivotsCtr() - 1);
     }
 
     /**
@@ -407,12 +818,16 @@ public:
     bool insertInLeaf(std::pair<key_type, value_type> buffer_elements[], int &num)
     {
         // make sure that caller node is a leaf
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
 
         assert(*is_leaf);
 
         // set node as dirty
         manager->addDirtyNode(id);
+        data->interpolate = false;
+
+        for (int k = 0; k < num; k++)
+            data->rebaseFor(buffer_elements[k].first);
 
         // we want to maintain all elements in the leaf in a sorted order
         // since existing elements will be sorted and the buffer elements will also come
@@ -426,21 +841,21 @@ public:
         {
             if (i >= 0)
             {
-                if (data->data[i] > buffer_elements[j])
+                if (data->pairAt(i) > buffer_elements[j])
                 {
                     // copy element
-                    data->data[last_index] = data->data[i];
+                    data->setPair(last_index, data->pairAt(i));
                     i--;
                 }
                 else
                 {
-                    data->data[last_index] = buffer_elements[j];
+                    data->setPair(last_index, buffer_elements[j]);
                     j--;
                 }
             }
             else
             {
-                data->data[last_index] = buffer_elements[j];
+                data->setPair(last_index, buffer_elements[j]);
                 j--;
             }
             last_index--;
@@ -450,12 +865,12 @@ public:
 
         // check if after adding, the leaf  has exceeded limit and
         // return accordingly
-        return data->size >= knobs::NUM_DATA_PAIRS;
+        return data->size >= knobs::NUM_DATA_PAIRS || data->needsSplit();
     }
 
     bool insertInLeaf(std::pair<key_type, value_type> element)
     {
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         assert(*is_leaf);
         // set node as dirty
         manager->addDirtyNode(id);
@@ -463,13 +878,63 @@ public:
         // TODO: Here we change the comparison between "std::pair"s to "std::pair::first" since 
         //the workload generator may produce duplicated key.
         if (data->size > 0)
-            assert(element.first >= data->data[data->size - 1].first);
+            assert(element.first >= data->keyAt(data->size - 1));
 
-        data->data[data->size++] = element;
+        data->interpolate = false;
+        data->rebaseFor(element.first);
+        data->setPair(data->size++, element);
 
         // check if after adding, the leaf  ` has exceeded limit and
         // return accordingly
-        return data->size >= knobs::NUM_DATA_PAIRS;
+        return data->size >= knobs::NUM_DATA_PAIRS || data->needsSplit();
+    }
+
+    // position of [key] by linear interpolation between the first and the
+    // last key of the leaf, which must differ
+    int interpolatedPosition(key_type key)
+    {
+        return interpolatePosition(data->keyAt(0), data->keyAt(data->size - 1), data->size, key);
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: called once the leaf takes no more pairs. Flags the leaf for
+     *  interpolation search if every key is within INTERPOLATION_ERROR
+     *  positions of its interpolated position, i.e. the keys are spread
+     *  almost evenly over the leaf's key range.
+     */
+    void sealLeaf()
+    {
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
+        assert(*is_leaf);
+
+        bool interpolate = knobs::INTERPOLATION_ERROR > 0 && data->size > 1 && data->keyAt(0) < data->keyAt(data->size - 1);
+        for (int i = 0; interpolate && i < data->size; i++)
+            interpolate = abs(interpolatedPosition(data->keyAt(i)) - i) <= knobs::INTERPOLATION_ERROR;
+
+        if (interpolate != data->interpolate)
+        {
+            data->interpolate = interpolate;
+            manager->addDirtyNode(id);
+        }
+    }
+
+    // checks if one of the data pairs in [lo, hi) of the leaf has key [key]
+    bool leafContains(key_type key, int lo, int hi)
+    {
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
+        assert(*is_leaf && 0 <= lo && lo <= hi && hi <= data->size);
+
+        return data->containsIn(key, lo, hi);
+    }
+
+    // checks if the leaf can take [key] without being split (see Data::fits)
+    bool fitsInLeaf(key_type key)
+    {
+        open();
+        assert(*is_leaf);
+
+        return data->fits(key);
     }
 
     /**
@@ -480,14 +945,15 @@ public:
     {
 
         // make sure that caller is a leaf node
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         assert(*is_leaf);
         // set node as dirty
         manager->addDirtyNode(id);
 
-        new_id = manager->allocate();
+        new_id = manager->allocate(id);
         // create new node
         BeNode<key_type, value_type, knobs, compare> new_sibling(manager, new_id);
+        NodeHandle<key_type, value_type, knobs, compare> sibling_handle(new_sibling);
         new_sibling.setParent(*parent);
         new_sibling.setLeaf(true);
         new_sibling.setRoot(false);
@@ -504,20 +970,30 @@ public:
 #elif SPLIT80
         start_index = 0.8 * (data->size);
 #endif
+        // a compressed leaf holding a key outside its frame splits next to
+        // that key instead
+        int isolated = data->isolatingSplit();
+        if (isolated > 0)
+            start_index = isolated;
+
+        new_sibling.data->rebaseFor(data->keyAt(start_index));
         for (int i = start_index; i < data->size; i++)
         {
-            new_sibling.data->data[new_sibling.data->size++] = data->data[i];
+            new_sibling.data->setPair(new_sibling.data->size++, data->pairAt(i));
         }
 
         int data_init_size = data->size;
 
         // update size of old node
-        data->size -= new_sibling.data->size;
+        data->truncate(data->size - new_sibling.data->size);
+        data->interpolate = false;
 
 #if defined(SPLIT70) || defined(SPLIT80) || defined(BULKLOAD)
-        assert(data->size >= new_sibling.data->size);
+        assert(isolated > 0 || data->size >= new_sibling.data->size);
 #else   
-        if(split_frac <= 0.5)
+        if (isolated > 0)
+            ;
+        else if(split_frac <= 0.5)
             assert(data->size <= new_sibling.data->size);
         else
             assert(data->size >= new_sibling.data->size);
@@ -530,7 +1006,7 @@ public:
         new_sibling.setParent(*parent);
 
         // split_key becomes lower bound of newly added sibling's keys
-        split_key = data->data[data->size - 1].first;
+        split_key = data->keyAt(data->size - 1);
 
         return new_id;
     }
@@ -543,7 +1019,7 @@ public:
     int splitInternal(key_type &split_key, BeTraits &traits, uint &new_id, const float split_frac = 0.5)
     {
 
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         // make sure that caller is not a leaf node
         assert(!*is_leaf);
 
@@ -554,14 +1030,30 @@ public:
         assert(getPivotsCtr() == knobs::NUM_PIVOTS);
 
         // create a new node (blockid, parent = this->parent, is_leaf = false)
-        new_id = manager->allocate();
+        new_id = manager->allocate(id);
         BeNode<key_type, value_type, knobs, compare> new_node(manager, new_id, *parent, false, false, *next_node);
+        NodeHandle<key_type, value_type, knobs, compare> new_handle(new_node);
         traits.num_blocks++;
 
         manager->addDirtyNode(new_id);
 
         BeNode temp_mover(manager, new_id);
 
+        // with PIVOTS_EYTZINGER the keys are split in sorted order and laid
+        // out again in both nodes afterwards
+        const bool eytzinger = knobs::PIVOT_LAYOUT == PIVOTS_EYTZINGER;
+        key_type *keys = child_key_values;
+        key_type *new_keys = new_node.child_key_values;
+        std::vector<key_type> sorted_keys, sorted_new_keys;
+        if (eytzinger)
+        {
+            sorted_keys.resize(knobs::NUM_CHILDREN);
+            sorted_new_keys.resize(knobs::NUM_CHILDREN);
+            readChildKeys(sorted_keys.data());
+            keys = sorted_keys.data();
+            new_keys = sorted_new_keys.data();
+        }
+
         // move half the pivots to the new node
         int start_index = (getPivotsCtr()) * split_frac;
 
@@ -574,12 +1066,10 @@ public:
 #endif
         for (int i = start_index; i < getPivotsCtr(); i++)
         {
-            open();
-            new_node.open();
             // move all child keys
             if (i < getPivotsCtr() - 1)
             {
-                new_node.child_key_values[i - start_index] = child_key_values[i];
+                new_keys[i - start_index] = keys[i];
             }
             // move all pointers
             new_node.pivot_pointers[i - start_index] = pivot_pointers[i];
@@ -598,7 +1088,13 @@ public:
         // alternatively, it is the pointer at pivots_ctr in the old node
         // since those have not been destroyed but the counter has been decreased
         // split_key = new_node->getChildKey(0); //[pivots_ctr]; // essentially, new_node.child_key_values[0]
-        split_key = getChildKey(getPivotsCtr() - 1);
+        split_key = keys[getPivotsCtr() - 1];
+
+        if (eytzinger)
+        {
+            writeChildKeys(keys);
+            new_node.writeChildKeys(new_keys);
+        }
 
         // move buffer elements to new node as required
         // create a temp buffer that will later replace the old buffer with elements removed
@@ -652,7 +1148,7 @@ public:
     void prepare_for_flush(uint &chosen_child, int &num_to_flush, std::pair<key_type, value_type> *&elements_to_flush)
     {
 
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         assert(!*is_leaf);
 
         if (isRoot())
@@ -762,13 +1258,13 @@ public:
     bool flushLeaf(BeNode<key_type, value_type, knobs, compare> &child, std::pair<key_type, value_type> *elements_to_flush, int &num_to_flush, key_type &split_key, uint &new_node_id, BeTraits &traits)
     {
         // make sure caller is not a leaf node
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         assert(!*is_leaf);
 
         // set node as dirty
         manager->addDirtyNode(id);
 
-        child.open();
+        NodeHandle<key_type, value_type, knobs, compare> child_handle(child);
         manager->addDirtyNode(child.getId());
 
         // make sure child is a leaf node
@@ -801,11 +1297,11 @@ public:
     {
 
         // make sure caller is not a leaf node
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
 
         assert(!*is_leaf);
 
-        child.open();
+        NodeHandle<key_type, value_type, knobs, compare> child_handle(child);
 
         // set node as dirty
         manager->addDirtyNode(id);
@@ -858,7 +1354,7 @@ public:
     Result flushLevel(key_type &split_key, uint &new_node_id, BeTraits &traits)
     {
 
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
 
         int num_to_flush = 0;
         uint chosen_child_idx = 0;
@@ -873,7 +1369,7 @@ public:
 
         // fetch the child node that has been chosen to flush to
         BeNode<key_type, value_type, knobs, compare> child(manager, pivot_pointers[chosen_child_idx]);
-        child.open();
+        NodeHandle<key_type, value_type, knobs, compare> child_handle(child);
         manager->addDirtyNode(id);
 
         Result res = NOSPLIT;
@@ -928,7 +1424,7 @@ public:
     bool addPivot(key_type &split_key, uint &new_node_id)
     {
 
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         assert(!*is_leaf);
 
         // set node as dirty
@@ -936,24 +1432,178 @@ public:
 
         int node_position = slotOfKey(split_key);
 
+        // with PIVOTS_EYTZINGER the key is inserted in sorted order and the
+        // keys are laid out again
+        const bool eytzinger = knobs::PIVOT_LAYOUT == PIVOTS_EYTZINGER;
+        key_type *keys = child_key_values;
+        std::vector<key_type> sorted_keys;
+        if (eytzinger)
+        {
+            sorted_keys.resize(knobs::NUM_CHILDREN);
+            readChildKeys(sorted_keys.data());
+            keys = sorted_keys.data();
+        }
+
         for (int i = getPivotsCtr() - 1; i >= node_position; i--)
         {
             pivot_pointers[i + 2] = pivot_pointers[i + 1];
-            child_key_values[i + 1] = child_key_values[i];
+            keys[i + 1] = keys[i];
         }
 
-        child_key_values[node_position] = split_key;
+        keys[node_position] = split_key;
         pivot_pointers[node_position + 1] = new_node_id;
 
         setPivotCounter(getPivotsCtr() + 1);
 
+        if (eytzinger)
+            writeChildKeys(keys);
+
         return getPivotsCtr() == knobs::NUM_PIVOTS;
     }
 
+    /**
+     *  returns: N/A
+     *  Function: drops the child in [slot] and the child key in [key_slot],
+     *  which is slot - 1 if the child's keys go to its left sibling and slot
+     *  if they go to its right one.
+     */
+    void removeChild(int slot, int key_slot)
+    {
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
+        assert(!*is_leaf && getPivotsCtr() > 1);
+        assert(key_slot == slot - 1 || key_slot == slot);
+
+        manager->addDirtyNode(id);
+
+        const bool eytzinger = knobs::PIVOT_LAYOUT == PIVOTS_EYTZINGER;
+        key_type *keys = child_key_values;
+        std::vector<key_type> sorted_keys;
+        if (eytzinger)
+        {
+            sorted_keys.resize(knobs::NUM_CHILDREN);
+            readChildKeys(sorted_keys.data());
+            keys = sorted_keys.data();
+        }
+
+        for (int i = slot; i < getPivotsCtr() - 1; i++)
+            pivot_pointers[i] = pivot_pointers[i + 1];
+        for (int i = key_slot; i < getPivotsCtr() - 2; i++)
+            keys[i] = keys[i + 1];
+
+        setPivotCounter(getPivotsCtr() - 1);
+
+        if (eytzinger)
+            writeChildKeys(keys);
+    }
+#ifdef BPLUS
+
+    /**
+     *  returns: false if the leaf has no pair with key [key]
+     *  Function: removes one pair with key [key] from the leaf
+     */
+    bool removeFromLeaf(key_type key)
+    {
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
+        assert(*is_leaf);
+
+        int lo = 0, hi = data->size;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (data->keyAt(mid) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == data->size || key < data->keyAt(lo))
+            return false;
+
+        manager->addDirtyNode(id);
+        for (int i = lo; i < data->size - 1; i++)
+            data->setPair(i, data->pairAt(i + 1));
+        data->truncate(data->size - 1);
+        data->interpolate = false;
+
+        return true;
+    }
+
+    /**
+     *  returns: false if the nodes are too full to be merged
+     *  Function: merges [right], the next sibling of the node under the same
+     *  parent, into the node. [separator] is the parent's child key between
+     *  the two. Nodes are merged if they fill at most three quarters of a
+     *  node together, so that the merged node does not split again right
+     *  away. The caller removes [right] from the parent and frees its block.
+     */
+    bool absorb(BeNode &right, key_type separator)
+    {
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
+        NodeHandle<key_type, value_type, knobs, compare> right_handle(right);
+        assert(*is_leaf == *right.is_leaf && *next_node == right.getId());
+
+        if (*is_leaf)
+        {
+            int right_size = right.data->size;
+            if (data->size + right_size > 3 * knobs::NUM_DATA_PAIRS / 4)
+                return false;
+            // a compressed leaf takes only the keys within its frame
+            if (right_size > 0 && !data->fits(right.data->keyAt(right_size - 1)))
+                return false;
+
+            if (right_size > 0)
+                data->rebaseFor(right.data->keyAt(0));
+            for (int i = 0; i < right_size; i++)
+                data->setPair(data->size++, right.data->pairAt(i));
+            data->interpolate = false;
+        }
+        else
+        {
+            int num_children = getPivotsCtr(), right_children = right.getPivotsCtr();
+            if (num_children + right_children > 3 * knobs::NUM_PIVOTS / 4)
+                return false;
+
+            const bool eytzinger = knobs::PIVOT_LAYOUT == PIVOTS_EYTZINGER;
+            key_type *keys = child_key_values;
+            key_type *right_keys = right.child_key_values;
+            std::vector<key_type> sorted_keys, sorted_right_keys;
+            if (eytzinger)
+            {
+                sorted_keys.resize(knobs::NUM_CHILDREN);
+                sorted_right_keys.resize(knobs::NUM_CHILDREN);
+                readChildKeys(sorted_keys.data());
+                right.readChildKeys(sorted_right_keys.data());
+                keys = sorted_keys.data();
+                right_keys = sorted_right_keys.data();
+            }
+
+            keys[num_children - 1] = separator;
+            BeNode temp_mover(manager, right.pivot_pointers[0]);
+            for (int i = 0; i < right_children; i++)
+            {
+                if (i < right_children - 1)
+                    keys[num_children + i] = right_keys[i];
+                pivot_pointers[num_children + i] = right.pivot_pointers[i];
+
+                temp_mover.setToId(right.pivot_pointers[i]);
+                temp_mover.setParent(id);
+            }
+
+            setPivotCounter(num_children + right_children);
+            if (eytzinger)
+                writeChildKeys(keys);
+        }
+
+        *next_node = *right.next_node;
+        manager->addDirtyNode(id);
+
+        return true;
+    }
+#endif
+
 public:
     bool insertInBuffer(key_type key, value_type value)
     {
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
 
         std::pair<key_type, value_type> new_insert(key, value);
         buffer->buffer[buffer->size] = new_insert;
@@ -967,26 +1617,38 @@ public:
 
     bool query(key_type key, BeTraits &traits)
     {
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
 
         // if current node is a leaf
         // search all data pairs
         if (*is_leaf)
         {
-            // perform binary search
-            bool found = std::binary_search(data->data, data->data + data->size, key, compare_pair_kv<key_type, value_type>());
+            // interpolate in evenly filled leaves (see sealLeaf), perform
+            // binary search in the others
+            if (data->interpolate)
+            {
+                if (key < data->keyAt(0) || data->keyAt(data->size - 1) < key)
+                    return false;
+
+                int pos = interpolatedPosition(key);
+                return data->containsIn(key, std::max(0, pos - knobs::INTERPOLATION_ERROR),
+                                        std::min(data->size, pos + knobs::INTERPOLATION_ERROR + 1));
+            }
+
+            bool found = data->contains(key);
 
             return found;
         }
 
-        bool found = std::binary_search(buffer->buffer, buffer->buffer + buffer->size, key, compare_pair_kv<key_type, value_type>());
+        bool found = containsKey(buffer->buffer, buffer->size, key);
 
         if (found)
             return true;
 
         // if not found in buffer, we need to search its pivots
         int chosen_child_idx = slotOfKey(key);
-        BeNode<key_type, value_type, knobs, compare> child(manager, pivot_pointers[chosen_child_idx]);
+        BeNode<key_type, value_type, knobs, compare> child(manager, 0);
+        NodeHandle<key_type, value_type, knobs, compare> child_handle(child, *this, chosen_child_idx);
 
         return child.query(key, traits);
     }
@@ -994,7 +1656,7 @@ public:
 public:
     std::vector<std::pair<key_type, value_type>> getElementsInRangeInBuffer(key_type low, key_type high, bool &corner)
     {
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
 
         std::vector<std::pair<key_type, value_type>> elements;
         // corner cases
@@ -1021,11 +1683,11 @@ public:
 
     std::vector<std::pair<key_type, value_type>> getElementsInRangeInLeaf(key_type low, key_type high, bool &corner)
     {
-        open();
+        NodeHandle<key_type, value_type, knobs, compare> handle(*this);
         std::vector<std::pair<key_type, value_type>> elements;
 
         // corner cases
-        if (data->data[0].first > high)
+        if (data->keyAt(0) > high)
         {
             corner = true;
             return elements;
@@ -1033,13 +1695,13 @@ public:
 
         for (int i = 0; i < data->size; i++)
         {
-            if (data->data[i].first >= low && data->data[i].first <= high)
-                elements.push_back(data->data[i]);
+            if (data->keyAt(i) >= low && data->keyAt(i) <= high)
+                elements.push_back(data->pairAt(i));
 
             // we can easily detect a corner case here itself
-            // if data->data[i] > high, then we can conclude that no next node
+            // if data->keyAt(i) > high, then we can conclude that no next node
             // will contain elements in the range after this node
-            if (data->data[i].first > high)
+            if (data->keyAt(i) > high)
                 corner = true;
         }
 
@@ -1123,7 +1785,13 @@ public:
                         }
                     }
 
-                    current_node.setToId(*current_node.getNextNode());
+                    uint next_id = *current_node.getNextNode();
+                    if (!flag)
+                        manager->followLeafChain(current_node.getId(), next_id);
+
+                    // the scan is done with the blocks it opened so far
+                    BufferPool::releasePinScope();
+                    current_node.setToId(next_id);
 
                     if (current_node.getId() == 0)
                         break;
@@ -1158,7 +1826,9 @@ public:
                         }
                     }
 
-                    current_node.setToId(*current_node.getNextNode());
+                    uint next_id = *current_node.getNextNode();
+                    BufferPool::releasePinScope();
+                    current_node.setToId(next_id);
 
                     if (current_node.getId() == 0)
                         break;
@@ -1203,6 +1873,10 @@ public:
         return id;
     }
 
+    // id of the node without opening it, for threads that share the node
+    // object only to learn where to start
+    uint getBlockId() { return id; }
+
     void setId(uint _id)
     {
         open();
@@ -1238,7 +1912,7 @@ public:
         open();
         assert(*is_leaf);
 
-        return data->data[data->size - 1];
+        return data->pairAt(data->size - 1);
     }
 
     void setDataSize(int _size)
@@ -1268,7 +1942,7 @@ public:
         open();
         assert(slot >= 0);
 
-        child_key_values[slot] = child_key;
+        child_key_values[childKeyIndex(slot)] = child_key;
         manager->addDirtyNode(id);
     }
 
@@ -1294,7 +1968,7 @@ public:
         open();
         assert(slot >= 0);
 
-        return child_key_values[slot];
+        return child_key_values[childKeyIndex(slot)];
     }
 
     key_type *getChildKeyReference(int slot)
@@ -1302,7 +1976,7 @@ public:
         open();
         assert(slot >= 0);
 
-        return &child_key_values[slot];
+        return &child_key_values[childKeyIndex(slot)];
     }
 
     key_type getDataPairKey(int slot)
@@ -1310,7 +1984,7 @@ public:
         open();
         assert(slot >= 0);
 
-        return data->data[slot].first;
+        return data->keyAt(slot);
     }
 
     key_type *getDataPairKeyReference(int slot)
@@ -1318,7 +1992,7 @@ public:
         open();
         assert(slot >= 0);
 
-        return &data->data[slot].first;
+        return &data->keyAt(slot);
     }
 
 public:
@@ -1448,6 +2122,31 @@ public:
     }
 };
 
+/**
+ *  Holds a node for as long as the handle lives (see BeNode::hold): the node
+ *  is looked up once, its frame cannot be evicted and calls on the node do not
+ *  reopen it. Handles on the same node nest.
+ */
+template <typename key_type, typename value_type, typename knobs, typename compare>
+class NodeHandle
+{
+    BeNode<key_type, value_type, knobs, compare> &node;
+
+public:
+    NodeHandle(BeNode<key_type, value_type, knobs, compare> &_node) : node(_node) { node.hold(); }
+
+    // moves [_node] to the child in [slot] of the held node [parent] and holds it
+    NodeHandle(BeNode<key_type, value_type, knobs, compare> &_node, BeNode<key_type, value_type, knobs, compare> &parent, int slot) : node(_node) { node.holdChild(parent, slot); }
+
+    ~NodeHandle() { node.unhold(); }
+
+    BeNode<key_type, value_type, knobs, compare> *operator->() { return &node; }
+
+private:
+    NodeHandle(const NodeHandle &);
+    NodeHandle &operator=(const NodeHandle &);
+};
+
 template <typename _Key, typename _Value,
           typename _Knobs = BeTree_Default_Knobs<_Key, _Value>,
           typename _Compare = std::less<_Key>>
@@ -1470,6 +2169,15 @@ public:
 
     BlockManager *manager;
 
+    // pool created by the tree itself if none was passed in
+    BufferPool *own_pool;
+
+    // queries hold it shared and modifications exclusive, so any number of
+    // threads can query the tree while no one modifies it. Bulk loads and
+    // whole-tree walks (fanout, getNumKeys, ...) assume that no other thread
+    // uses the tree or its buffer pool.
+    RWLatch tree_latch;
+
 public:
     BeNode<key_type, value_type, knobs, compare> *root;
 
@@ -1488,26 +2196,145 @@ public:
     _Key min_key;
     _Key max_key;
 
+    // model of the sealed leaves, with LEARNED_INDEX (see learnedQuery)
+    LearnedIndex<key_type> *learned;
+
+    // what the tree keeps outside its blocks, saved next to the tree file
+    // ("<tree>.meta") by every flush so that the tree can be reopened
+    struct TreeMeta
+    {
+        uint root_id;
+
+        // blocks of the nodes head_leaf, tail_leaf and second_tail_leaf
+        // point to, 0 for none
+        uint head_leaf;
+        uint tail_leaf;
+        uint second_tail_leaf;
+
+        uint head_leaf_id;
+        uint tail_leaf_id;
+        _Key min_key;
+        _Key max_key;
+        BeTraits traits;
+    };
+
+    std::string meta_file_name;
+
+    // set once the tree was flushed or opened with reopen; only then does the
+    // destructor save the meta file, so throwaway trees leave none behind
+    bool save_meta;
+
+    void saveMeta()
+    {
+        TreeMeta meta;
+        meta.root_id = root->getId();
+        meta.head_leaf = head_leaf != nullptr ? head_leaf->getId() : 0;
+        meta.tail_leaf = tail_leaf != nullptr ? tail_leaf->getId() : 0;
+        meta.second_tail_leaf = second_tail_leaf != nullptr ? second_tail_leaf->getId() : 0;
+        meta.head_leaf_id = head_leaf_id;
+        meta.tail_leaf_id = tail_leaf_id;
+        meta.min_key = min_key;
+        meta.max_key = max_key;
+        meta.traits = traits;
+
+        std::string tmp_name = meta_file_name + ".tmp";
+        std::ofstream out(tmp_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        out.write((char *)&meta, sizeof(meta));
+        out.close();
+
+        rename(tmp_name.c_str(), meta_file_name.c_str());
+    }
+
+    // returns false if no tree was saved under the name
+    bool loadMeta(TreeMeta &meta)
+    {
+        std::ifstream in(meta_file_name.c_str(), std::ios::in | std::ios::binary);
+        return (bool)in.read((char *)&meta, sizeof(meta));
+    }
+
+    // node object for block [id]; the nodes already restored are shared, so
+    // that pointers to the same leaf compare equal as they did before
+    BeNode<key_type, value_type, knobs, compare> *restoreNode(uint id)
+    {
+        BeNode<key_type, value_type, knobs, compare> *known[] = {root, tail_leaf, head_leaf};
+        if (id == 0)
+            return nullptr;
+        for (int i = 0; i < 3; i++)
+        {
+            if (known[i] != nullptr && known[i]->getId() == id)
+                return known[i];
+        }
+        return new BeNode<key_type, value_type, knobs, compare>(manager, id);
+    }
+
 public:
+    // if a buffer pool is given, the tree draws its frames from it (and
+    // _blocks_in_memory is ignored); the pool must outlive the tree. With
+    // reopen, the tree saved under the same name and directory by its last
+    // flush is opened again, and with WARM_UP_SNAPSHOT its cache is warmed up
+    // from the last snapshot; a new tree is created if there is none. The
+    // learned index only covers the leaves sealed after reopening.
     BeTree(std::string _name, std::string _rootDir, unsigned long long _size_of_each_block, 
-        uint _blocks_in_memory, float split_frac=0.5) : tail_leaf(nullptr), head_leaf(nullptr), split_frac(split_frac)
+        uint _blocks_in_memory, float split_frac=0.5, BufferPool *_pool=nullptr, bool reopen=false) : own_pool(nullptr), root(nullptr), tail_leaf(nullptr), second_tail_leaf(nullptr), head_leaf(nullptr), split_frac(split_frac), learned(nullptr), save_meta(reopen)
     {
-        manager = new BlockManager(_name, _rootDir, _size_of_each_block, _blocks_in_memory);
+        if (_pool == nullptr && knobs::STORAGE_MODE == STORAGE_BUFFERED)
+        {
+            _pool = own_pool = new BufferPool(_blocks_in_memory, knobs::HUGE_PAGES, knobs::CACHE_POLICY);
+            own_pool->setPinFraction(knobs::INTERNAL_POOL_FRACTION);
+            if (knobs::POINTER_SWIZZLING)
+                own_pool->enableSwizzling(knobs::NUM_CHILDREN);
+            if (knobs::BACKGROUND_WRITEBACK)
+                own_pool->startWriteBack(knobs::WRITEBACK_HIGH_WATERMARK, knobs::WRITEBACK_LOW_WATERMARK);
+        }
+
+        meta_file_name = _rootDir + "/" + _name + ".meta";
+        TreeMeta meta;
+        bool reopened = reopen && loadMeta(meta);
+
+        manager = new BlockManager(_name, _rootDir, _size_of_each_block, _blocks_in_memory, createIOBackend(knobs::IO_BACKEND), knobs::STORAGE_MODE, _pool, reopened);
+        manager->setWarmUpSnapshot(knobs::WARM_UP_SNAPSHOT);
+        manager->setMissRatioSampling(knobs::MISS_RATIO_SAMPLE_RATE);
 
-        uint root_id = manager->allocate();
-        root = new BeNode<key_type, value_type, knobs, compare>(manager, root_id);
-        root->setRoot(true);
-        root->setLeaf(true);
+        if (reopened)
+        {
+            // the cache starts out as it was at the last flush
+            if (knobs::WARM_UP_SNAPSHOT)
+                manager->warmUp();
+
+            root = restoreNode(meta.root_id);
+            tail_leaf = restoreNode(meta.tail_leaf);
+            head_leaf = restoreNode(meta.head_leaf);
+            second_tail_leaf = restoreNode(meta.second_tail_leaf);
+
+            head_leaf_id = meta.head_leaf_id;
+            tail_leaf_id = meta.tail_leaf_id;
+            min_key = meta.min_key;
+            max_key = meta.max_key;
+            traits = meta.traits;
+        }
+        else
+        {
+            uint root_id = manager->allocate();
+            root = new BeNode<key_type, value_type, knobs, compare>(manager, root_id);
+            root->setRoot(true);
+            root->setLeaf(true);
 
-        head_leaf_id = root_id;
-        tail_leaf_id = root_id;
+            head_leaf_id = root_id;
+            tail_leaf_id = root_id;
+        }
 
+        if (knobs::LEARNED_INDEX)
+            learned = new LearnedIndex<key_type>(knobs::LEARNED_INDEX_ERROR);
     }
 
     ~BeTree()
     {
+        if (save_meta)
+            saveMeta();
+        delete learned;
         delete root;
         delete manager;
+        delete own_pool;
     }
 
 public:
@@ -1528,6 +2355,8 @@ public:
 
     key_type get_tail_leaf_minimum_key()
     {
+        RWLatchGuard guard(tree_latch, false);
+        FramePinScope pins;
         if(tail_leaf == nullptr)
         {
             return min_key;
@@ -1543,6 +2372,8 @@ public:
     } 
 
     key_type get_second_tail_leaf_maximum_ley(){
+        RWLatchGuard guard(tree_latch, false);
+        FramePinScope pins;
         assert(second_tail_leaf != nullptr);
         return second_tail_leaf->getLastDataPair().first;
     }   
@@ -1550,10 +2381,16 @@ public:
 public:
     bool insert(key_type key, value_type value)
     {
+        RWLatchGuard guard(tree_latch, true);
+        FramePinScope pins;
 #ifdef TIMER
         auto start = std::chrono::high_resolution_clock::now();
 #endif
 
+        // the learned index only models trees built by insert_to_tail_leaf
+        if (learned != nullptr)
+            learned->clear();
+
         // if root is a leaf node, we insert in leaf until it exceeds capacity
         root->open();
         manager->addDirtyNode(root->getId());
@@ -1742,6 +2579,8 @@ public:
     */
     bool insert_to_tail_leaf(key_type key, value_type val, bool append)
     {   
+        RWLatchGuard guard(tree_latch, true);
+        FramePinScope pins;
         bool need_split;
         if(tail_leaf == nullptr)
         {
@@ -1779,7 +2618,8 @@ public:
             return true;
         }
         key_type split_key_leaf = tail_leaf->getDataPairKey(tail_leaf->getDataSize() - 1);
-        uint new_leaf_id = manager->allocate();
+        // splitLeaf allocates the new leaf next to the tail leaf
+        uint new_leaf_id;
         tail_leaf->splitLeaf(split_key_leaf, this->traits, new_leaf_id, split_frac);
         traits.leaf_splits++;
         BeNode<key_type, value_type, knobs, compare> *new_leaf = 
@@ -1887,18 +2727,227 @@ public:
             }
         }
 
+        // nothing is inserted into the old tail leaf anymore
+        second_tail_leaf->sealLeaf();
+        if (learned != nullptr)
+        {
+            BeNode<key_type, value_type, knobs, compare> &sealed = *second_tail_leaf;
+            NodeHandle<key_type, value_type, knobs, compare> sealed_handle(sealed);
+            learned->addLeaf(sealed.getId(), sealed.getDataSize(), [&](int i) { return sealed.getDataPairKey(i); });
+        }
+        manager->sealBlock(second_tail_leaf->getId());
+
+        return true;
+    }
+#ifdef BPLUS
+
+    /**
+     *  returns: false if the tree has no pair with key [key]
+     *  Function: removes one pair with key [key]. A leaf that fills at most
+     *  three quarters of a node together with a sibling under the same
+     *  parent is merged with it (see BeNode::absorb), and so are the internal nodes up the
+     *  path; a root left with a single child is replaced by it. The blocks of
+     *  the merged away nodes go back to the free list of the block manager,
+     *  where the next splits pick them up.
+     */
+    bool remove(key_type key)
+    {
+        RWLatchGuard guard(tree_latch, true);
+        std::vector<uint> freed;
+        bool found;
+        {
+            FramePinScope pins;
+            found = removeKey(key, freed);
+        }
+
+        // the pin scope keeps the frames of the freed blocks in use until it ends
+        for (size_t i = 0; i < freed.size(); i++)
+            manager->deallocate(freed[i]);
+
+        return found;
+    }
+
+    // removes [key] as described in remove(), adding the ids of the blocks
+    // that are no longer used to [freed]
+    bool removeKey(key_type key, std::vector<uint> &freed)
+    {
+        // internal nodes on the way to the leaf and the slots taken in them
+        std::vector<uint> path;
+        std::vector<int> slots;
+        BeNode<key_type, value_type, knobs, compare> node(manager, root->getId());
+        while (!node.isLeaf())
+        {
+            path.push_back(node.getId());
+            slots.push_back(node.slotOfKey(key));
+            node.setToId(node.getPivot(slots.back()));
+        }
+
+        if (!node.removeFromLeaf(key))
+            return false;
+
+        // the positions of the keys after it have moved
+        if (learned != nullptr)
+            learned->clear();
+
+        // a node that merges leaves its parent with one child less, so the
+        // parent is tried next
+        for (int level = (int)path.size() - 1; level >= 0; level--)
+        {
+            BeNode<key_type, value_type, knobs, compare> parent(manager, path[level]);
+            bool merged = false;
+
+            // with the right sibling first, then with the left one
+            for (int left = slots[level]; left >= slots[level] - 1 && !merged; left--)
+            {
+                if (left < 0 || left + 1 >= parent.getPivotsCtr())
+                    continue;
+
+                BeNode<key_type, value_type, knobs, compare> left_node(manager, parent.getPivot(left));
+                BeNode<key_type, value_type, knobs, compare> right_node(manager, parent.getPivot(left + 1));
+                merged = left_node.absorb(right_node, parent.getChildKey(left));
+                if (merged)
+                {
+                    parent.removeChild(left + 1, left);
+                    freed.push_back(right_node.getId());
+                    traits.num_blocks--;
+                }
+            }
+
+            if (!merged)
+                break;
+        }
+
+        while (!root->isLeaf() && root->getPivotsCtr() == 1)
+        {
+            freed.push_back(root->getId());
+            traits.num_blocks--;
+
+            root->setToId(root->getPivot(0));
+            root->setRoot(true);
+            root->setParent(0);
+        }
+
+        if (root->isLeaf())
+        {
+            // back to a single leaf, tracked as in a new tree
+            if (head_leaf != root || tail_leaf != root)
+            {
+                releaseLeafNodes();
+                head_leaf = tail_leaf = root;
+                second_tail_leaf = nullptr;
+            }
+            head_leaf_id = tail_leaf_id = root->getId();
+        }
+        else if (std::find(freed.begin(), freed.end(), tail_leaf_id) != freed.end() ||
+                 (second_tail_leaf != nullptr && std::find(freed.begin(), freed.end(), second_tail_leaf->getId()) != freed.end()))
+        {
+            findTailLeaves();
+        }
+
+        return true;
+    }
+
+    // points tail_leaf and second_tail_leaf to the last two leaves of the
+    // tree again, after a merge freed the block of one of them
+    void findTailLeaves()
+    {
+        // the last leaf is at the end of the path of last children, the leaf
+        // before it is the last one under the lowest node of the path with
+        // more than one child
+        std::vector<uint> path;
+        BeNode<key_type, value_type, knobs, compare> node(manager, root->getId());
+        while (!node.isLeaf())
+        {
+            path.push_back(node.getId());
+            node.setToId(node.getPivot(node.getPivotsCtr() - 1));
+        }
+        uint last = node.getId();
+
+        uint before = 0;
+        for (size_t i = path.size(); i-- > 0 && before == 0;)
+        {
+            node.setToId(path[i]);
+            if (node.getPivotsCtr() > 1)
+                before = node.getPivot(node.getPivotsCtr() - 2);
+        }
+        assert(before != 0);
+        node.setToId(before);
+        while (!node.isLeaf())
+            node.setToId(node.getPivot(node.getPivotsCtr() - 1));
+
+        // the node objects move along, unless root or head_leaf share them
+        if (tail_leaf == root || tail_leaf == head_leaf)
+            tail_leaf = new BeNode<key_type, value_type, knobs, compare>(manager, last);
+        else
+            tail_leaf->setToId(last);
+        tail_leaf_id = last;
+
+        if (second_tail_leaf == nullptr || second_tail_leaf == root || second_tail_leaf == head_leaf || second_tail_leaf == tail_leaf)
+            second_tail_leaf = new BeNode<key_type, value_type, knobs, compare>(manager, node.getId());
+        else
+            second_tail_leaf->setToId(node.getId());
+    }
+
+    // deletes the node objects of head_leaf, tail_leaf and second_tail_leaf
+    // that root does not use, each once as they may be shared
+    void releaseLeafNodes()
+    {
+        BeNode<key_type, value_type, knobs, compare> *nodes[] = {head_leaf, tail_leaf, second_tail_leaf};
+        for (int i = 0; i < 3; i++)
+        {
+            bool shared = nodes[i] == nullptr || nodes[i] == root;
+            for (int j = 0; j < i; j++)
+                shared = shared || nodes[j] == nodes[i];
+            if (!shared)
+                delete nodes[i];
+        }
+    }
+#endif
+
+    /**
+     *  returns: false if the learned index does not cover [key], true
+     *  otherwise, with [found] set
+     *  Function: looks [key] up in the sealed leaves through the learned
+     *  index: the model gives the positions that may hold the key, and only
+     *  those are searched, in the one or two leaves they fall in. Keys in the
+     *  tail leaf are left to the regular descent.
+     */
+    bool learnedQuery(key_type key, bool &found)
+    {
+        unsigned long long lo, hi;
+        if (learned == nullptr || !learned->locate(key, lo, hi))
+            return false;
+
+        found = false;
+        for (int leaf = learned->leafOf(lo); !found && leaf < learned->getNumLeaves() && learned->getLeafStart(leaf) < hi; leaf++)
+        {
+            unsigned long long start = learned->getLeafStart(leaf);
+            unsigned long long end = learned->getLeafEnd(leaf);
+
+            BeNode<key_type, value_type, knobs, compare> node(manager, learned->getLeafId(leaf));
+            found = node.leafContains(key, std::max(lo, start) - start, std::min(hi, end) - start);
+        }
         return true;
     }
 
     bool query(key_type key, key_type high = -1)
     {
+        RWLatchGuard guard(tree_latch, false);
+        FramePinScope pins;
+
         if (high < 0)
         {
 #ifdef TIMER
             auto start = std::chrono::high_resolution_clock::now();
 #endif
 
-            bool flag = root->query(key, traits);
+            bool flag;
+            if (!learnedQuery(key, flag))
+            {
+                // every thread descends with its own node object
+                BeNode<key_type, value_type, knobs, compare> top(manager, root->getBlockId());
+                flag = top.query(key, traits);
+            }
 
 #ifdef TIMER
             auto stop = std::chrono::high_resolution_clock::now();
@@ -1908,11 +2957,12 @@ public:
             return flag;
         }
 
+        BeNode<key_type, value_type, knobs, compare> top(manager, root->getBlockId());
 #ifdef TIMER
         auto start = std::chrono::high_resolution_clock::now();
 #endif
 
-        std::vector<std::pair<key_type, value_type>> elements = root->rangeQuery(key, high, traits);
+        std::vector<std::pair<key_type, value_type>> elements = top.rangeQuery(key, high, traits);
 
 #ifdef TIMER
         auto stop = std::chrono::high_resolution_clock::now();
@@ -1924,10 +2974,13 @@ public:
 
     std::vector<std::pair<key_type, value_type>> rangeQuery(key_type low, key_type high)
     {
+        RWLatchGuard guard(tree_latch, false);
+        FramePinScope pins;
+        BeNode<key_type, value_type, knobs, compare> top(manager, root->getBlockId());
 #ifdef TIMER
         auto start = std::chrono::high_resolution_clock::now();
 #endif
-        std::vector<std::pair<key_type, value_type>> elements = root->rangeQuery(low, high, traits);
+        std::vector<std::pair<key_type, value_type>> elements = top.rangeQuery(low, high, traits);
 #ifdef TIMER
         auto stop = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start);
@@ -1940,27 +2993,34 @@ public:
     template <typename Iterator>
     bool bulkLoad(Iterator ibegin, Iterator iend)
     {
+        RWLatchGuard guard(tree_latch, true);
 #ifdef TIMER
         auto start = std::chrono::high_resolution_clock::now();
 #endif
         size_t num_items = iend - ibegin;
-        size_t num_leaves = (num_items + knobs::NUM_DATA_PAIRS - 1) / knobs::NUM_DATA_PAIRS;
+        size_t num_leaves = 0;
 
         Iterator it = ibegin;
-        for (size_t i = 0; i < num_leaves; ++i)
+        while (num_items > 0)
         {
             // create new leaf
-            uint new_leaf_id = manager->allocate();
+            uint new_leaf_id = manager->allocate(tail_leaf != nullptr ? tail_leaf->getId() : 0);
 
             BeNode<key_type, value_type, knobs, compare> *leaf = new BeNode<key_type, value_type, knobs, compare>(manager, new_leaf_id);
             leaf->setLeaf(true);
+            num_leaves++;
 
-            int slots_to_use = static_cast<int>(num_items / (num_leaves - i));
+            // spread the items evenly over the leaves still needed
+            size_t leaves_left = (num_items + knobs::NUM_DATA_PAIRS - 1) / knobs::NUM_DATA_PAIRS;
+            int slots_to_use = static_cast<int>(num_items / leaves_left);
 
-            for (size_t s = 0; s < slots_to_use; ++s, ++it)
+            // a compressed leaf ends early at a key outside its frame
+            int s = 0;
+            for (; s < slots_to_use && leaf->fitsInLeaf(it->first); ++s, ++it)
             {
                 leaf->insertInLeaf(*it);
             }
+            slots_to_use = s;
 
             // set next leaf pointers
             if (tail_leaf != nullptr)
@@ -2008,9 +3068,10 @@ public:
             BeNode<key_type, value_type, knobs, compare> *n = new BeNode<key_type, value_type, knobs, compare>(manager, n_id);
 
             int slots_to_use = static_cast<int>((num_leaves - 1) / (num_parents - i));
-            // since internal node has one more pointer than keys, we reduce the counter
-
-            n->setPivotCounter(slots_to_use);
+            // since internal node has one more pointer than keys, the counter
+            // is one more than the number of keys. It is set up front so that
+            // child keys land in their place in the node's key layout
+            n->setPivotCounter(slots_to_use + 1);
 
             // copy last key from each leaf and set child
             for (int s = 0; s < slots_to_use; ++s)
@@ -2024,12 +3085,11 @@ public:
 
             n->open();
             leaf->open();
-            n->setPivot(leaf->getId(), n->getPivotsCtr());
-            n->setPivotCounter(n->getPivotsCtr() + 1);
+            n->setPivot(leaf->getId(), slots_to_use);
 
             // track max key of any descendant
             next_level[i].first = n->getId();
-            level_keys[i] = *leaf->getDataPairKeyReference(leaf->getDataSize() - 1);
+            level_keys[i] = leaf->getDataPairKey(leaf->getDataSize() - 1);
             next_level[i].second = &level_keys[i];
 
             leaf->setToId(*leaf->getNextNode());
@@ -2053,7 +3113,7 @@ public:
                 BeNode<key_type, value_type, knobs, compare> *n = new BeNode<key_type, value_type, knobs, compare>(manager, n_id);
 
                 int slots_to_use = static_cast<int>((num_children - 1) / (num_parents - i));
-                n->setPivotCounter(slots_to_use);
+                n->setPivotCounter(slots_to_use + 1);
 
                 for (int s = 0; s < slots_to_use; ++s)
                 {
@@ -2061,8 +3121,7 @@ public:
                     n->setPivot(next_level[inner_index].first, s);
                     ++inner_index;
                 }
-                n->setPivot(next_level[inner_index].first, n->getPivotsCtr());
-                n->setPivotCounter(n->getPivotsCtr() + 1);
+                n->setPivot(next_level[inner_index].first, slots_to_use);
 
                 // reuse nextlevel array for parents
                 next_level[i].first = n->getId();
@@ -2092,6 +3151,7 @@ public:
     template <typename Iterator>
     bool bulkload_leaf(Iterator ibegin, Iterator iend)
     {
+        FramePinScope pins;
 
         // first create leaf node
         uint new_leaf_id = manager->allocate();
@@ -2238,6 +3298,7 @@ public:
     template <typename Iterator>
     bool bulkload_helper(Iterator ibegin, Iterator iend)
     {
+        RWLatchGuard guard(tree_latch, true);
 #ifdef TIMER
         auto start = std::chrono::high_resolution_clock::now();
 #endif
@@ -2392,7 +3453,19 @@ public:
 
     unsigned long long getNumReads() { return manager->num_reads; }
 
-    unsigned long long getNumWrites() { return manager->num_writes; }
+    unsigned long long getNumWrites() { return manager->num_writes + manager->getBackgroundWrites(); }
+
+    // dirty blocks written inline while evicting them, on the insert or query path
+    unsigned long long getForegroundWrites() { return manager->getForegroundWrites(); }
+
+    // dirty blocks written ahead of eviction by the pool's background writer
+    unsigned long long getBackgroundWrites() { return manager->getBackgroundWrites(); }
+
+    // leaves written in sequential batches after being split off the tail
+    unsigned long long getSealedWrites() { return manager->getSealedWrites(); }
+
+    // number of segments of the learned index, 0 without LEARNED_INDEX
+    int getLearnedSegments() { return learned != nullptr ? learned->getNumSegments() : 0; }
 
     unsigned long long getNumKeys()
     {
@@ -2412,7 +3485,60 @@ public:
 
     uint getNumBlocks() { return manager->current_blocks; }
 
-    uint getBlocksInMemoryCap() { return manager->blocks_in_memory_cap; }
+    // writes all modified blocks back to the tree file
+    void flush()
+    {
+        manager->flush();
+        save_meta = true;
+        saveMeta();
+    }
+
+    // reloads the blocks saved by the last flush with WARM_UP_SNAPSHOT; returns
+    // the number of blocks read
+    uint warmUpCache() { return manager->warmUp(); }
+
+    // estimated hit ratio the tree would get from an LRU cache of
+    // [cache_blocks] blocks of its own, for accesses to blocks of class [cls].
+    // Needs MISS_RATIO_SAMPLE_RATE or setMissRatioSampling; 0 otherwise.
+    double getPredictedHitRatio(uint cache_blocks, BlockClass cls = BLOCK_ANY)
+    {
+        MissRatioCurve *mrc = manager->getMissRatioCurve();
+        return mrc ? mrc->predictHitRatio(cache_blocks, cls) : 0.0;
+    }
+
+    // smallest cache, in blocks, estimated to reach hit ratio [target]; 0 if
+    // none does or the estimation is off
+    uint getBlocksForHitRatio(double target, BlockClass cls = BLOCK_ANY)
+    {
+        MissRatioCurve *mrc = manager->getMissRatioCurve();
+        return mrc ? mrc->getBlocksForHitRatio(target, cls) : 0;
+    }
+
+    void setMissRatioSampling(double rate) { manager->setMissRatioSampling(rate); }
+
+    // switches the replacement policy of the tree's buffer pool (of all trees
+    // sharing it). Ignored in STORAGE_MMAP mode.
+    void setCachePolicy(CachePolicy policy)
+    {
+        if (manager->pool != nullptr)
+            manager->pool->setPolicy(policy);
+    }
+
+    // number of freed blocks waiting to be reused
+    uint getNumFreeBlocks() { return manager->getFreeBlocks(); }
+
+    // shrinks the tree file, see BlockManager::compact
+    uint compact() { return manager->compact(); }
+
+    uint getBlocksInMemoryCap() { return manager->getCacheCapacity(); }
+
+    // changes the number of blocks kept in memory without rebuilding the
+    // tree. Shrinking writes back and drops the least recently used blocks.
+    // If the pool is shared, this resizes it for all trees using it.
+    void setBlocksInMemoryCap(uint cap) { manager->setCacheCapacity(cap); }
+
+    // number of buffer pool frames currently holding blocks of this tree
+    uint getResidentBlocks() { return manager->getResidentBlocks(); }
 };
 
 #endif
\ No newline at end of file
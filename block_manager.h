@@ -7,15 +7,44 @@
 #include <ext/stdio_filebuf.h>
 #include <unistd.h>
 #include <cassert>
+#include <climits>
+#include <atomic>
+#include <mutex>
 #include "lru_cache.h"
+#include "io_backend.h"
+#include "buffer_pool.h"
+#include "miss_ratio_curve.h"
 #include <fstream>
 #include <list>
 #include <algorithm>
 #include <map>
+#include <set>
+#include <vector>
+#include <unordered_set>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
-#define BLOCK_SIZE_BYTES 4096
+// virtual address space reserved for the tree file in STORAGE_MMAP mode (64 GB)
+#define MMAP_RESERVE_BYTES (1ULL << 36)
+
+// number of blocks the tree file grows by at a time in STORAGE_MMAP mode
+#define MMAP_GROW_BLOCKS 1024
+
+// number of sealed blocks written together, see BlockManager::sealBlock
+#define SEAL_BATCH_BLOCKS 64
+
+// a free block at most this far after the allocation hint counts as
+// contiguous with it, see BlockManager::allocate
+#define ALLOC_EXTENT_BLOCKS 64
+
+// bounds of the readahead window of leaf chain scans, and the largest
+// forward jump between two leaves that still counts as sequential
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 256
+#define READAHEAD_MAX_GAP 8
 
 #ifdef PROFILE
 extern unsigned long openblock_time;
@@ -27,13 +56,15 @@ unsigned long readblock_time = 0;
 unsigned long writeblock_time = 0;
 #endif
 
-class Block
+enum StorageMode
 {
-public:
-    unsigned char block_buf[BLOCK_SIZE_BYTES];
+    // blocks are copied into frames of a BufferPool
+    STORAGE_BUFFERED,
+    // the tree file is memory mapped and the kernel page cache does the caching
+    STORAGE_MMAP,
 };
 
-class BlockManager
+class BlockManager : public BufferPoolOwner
 {
 public:
     std::string name;
@@ -41,65 +72,247 @@ public:
     uint current_blocks;
     int size_of_each_block;
     uint blocks_in_memory_cap;
-    LRUCache *open_blocks;
-    Block *internal_memory;
 
-    // std::list<int> dirty_nodes;
-    std::unordered_map<uint, uint> dirty_nodes;
+    // frames holding the blocks of this manager, possibly shared with other
+    // managers. owns_pool is set if the manager created the pool itself.
+    BufferPool *pool;
+    bool owns_pool;
+
+    // tag identifying the blocks of this manager inside the pool
+    uint pool_tag;
+
+    // descriptor of the parent file, kept open for the lifetime of the manager
+    int fd;
+
+    // I/O layer every block read and write goes through
+    IOBackend *io;
+
+    // holds an evicted dirty block while its write-back is in flight
+    Block *staging;
+
+    // serializes batches submitted to the I/O backend (and the use of
+    // staging), which several threads reading the tree may want at once
+    std::mutex io_latch;
+
+    // guards the readahead state
+    std::mutex readahead_latch;
+
+    StorageMode mode;
+
+    // STORAGE_MMAP: start of the mapping of the tree file, number of blocks
+    // the file currently holds and the major page faults at startup
+    unsigned char *mapping;
+    uint mapped_blocks;
+    long start_major_faults;
+
+    // returned for block id 0, the "no node" id
+    Block *null_block;
+
+    // block opened last and its frame, so that marking a node dirty right
+    // after opening it needs no pool lookup. Packed as id << 32 | frame
+    // position, so threads reading the tree can update it concurrently; the
+    // id is 0 if unset.
+    std::atomic<unsigned long long> last_open;
 
     uint blocks_written;
 
     // counters
-    unsigned long long num_reads, num_writes;
+    std::atomic<unsigned long long> num_reads, num_writes;
+
+    // write-backs of dirty blocks done inline when a block is evicted
+    std::atomic<unsigned long long> foreground_writes;
+
+    // highest block id that was ever written to the file. Blocks above it
+    // (like freshly allocated tail leaves) read back as zeros and are never
+    // read from disk.
+    std::atomic<uint> written_extent;
+
+    // ids of freed blocks, reused by allocate() and persisted next to the
+    // tree file (see getFreeListFileName)
+    std::set<uint> free_blocks;
+
+    // save the resident blocks on every flush, so warmUp() can load them again
+    bool warm_up_snapshot;
+
+    // sampled reuse distances of the accesses to the tree's blocks, nullptr
+    // unless enabled with setMissRatioSampling
+    MissRatioCurve *mrc;
+
+    // readahead state of the current leaf chain scan: the window size (0 if
+    // the scan is not sequential) and the first block id after the window
+    uint readahead_window;
+    uint readahead_end;
+    unsigned long long readahead_blocks;
+
+    // sealed blocks waiting to be written, and the number written so far
+    std::vector<uint> sealed_blocks;
+    unsigned long long sealed_writes;
 
     // more counters
-    unsigned long long leaf_cache_misses;
-    unsigned long long internal_cache_misses;
+    std::atomic<unsigned long long> leaf_cache_misses;
+    std::atomic<unsigned long long> internal_cache_misses;
 
-    unsigned long long leaf_cache_hits;
-    unsigned long long internal_cache_hits;
+    std::atomic<unsigned long long> leaf_cache_hits;
+    std::atomic<unsigned long long> internal_cache_hits;
 
-    unsigned long long total_cache_reqs;
+    std::atomic<unsigned long long> total_cache_reqs;
 
-    std::string getBlockFileName(int id)
+    std::string getParentFileName()
     {
-        return root_dir + "/" + std::to_string(id);
+        return root_dir + "/" + name;
     }
 
-    std::string getParentFileName()
+    std::string getFreeListFileName()
     {
-        return root_dir + "/" + name;
+        return root_dir + "/" + name + ".free";
     }
 
-    void writeBlock(uint id, uint pos)
+    std::string getWarmUpFileName()
     {
-#ifdef PROFILE
-        auto start = std::chrono::high_resolution_clock::now();
-#endif
-        if (pos >= blocks_in_memory_cap)
+        return root_dir + "/" + name + ".warm";
+    }
+
+    // writes the free list as a count followed by the block ids
+    void saveFreeList()
+    {
+        std::string tmp_name = getFreeListFileName() + ".tmp";
+        std::ofstream out(tmp_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+
+        uint count = free_blocks.size();
+        out.write((char *)&count, sizeof(count));
+        for (std::set<uint>::iterator it = free_blocks.begin(); it != free_blocks.end(); ++it)
+        {
+            uint id = *it;
+            out.write((char *)&id, sizeof(id));
+        }
+        out.close();
+
+        rename(tmp_name.c_str(), getFreeListFileName().c_str());
+    }
+
+    // reads the list written by saveFreeList, if there is one. Blocks past
+    // the end of the file were never written and are dropped with it.
+    void loadFreeList()
+    {
+        std::ifstream in(getFreeListFileName().c_str(), std::ios::in | std::ios::binary);
+        uint count = 0;
+        if (!in.read((char *)&count, sizeof(count)))
             return;
 
-        std::string filename = getParentFileName();
+        for (uint i = 0; i < count; i++)
+        {
+            uint id;
+            if (!in.read((char *)&id, sizeof(id)))
+                break;
+            if (id > 0 && id <= current_blocks)
+                free_blocks.insert(id);
+        }
+    }
 
-        std::ofstream fout(filename.c_str(), std::ios::out | std::ios::in | std::ios::binary);
+    // writes the blocks of the manager that are in the pool, hottest first, as
+    // the number of pinned blocks and the number of blocks followed by the ids
+    void saveWarmUpList()
+    {
+        uint num_pinned;
+        std::vector<uint> ids = pool->getResidentBlocksByRecency(pool_tag, num_pinned);
 
-        unsigned long long beg = fout.tellp();
+        std::string tmp_name = getWarmUpFileName() + ".tmp";
+        std::ofstream out(tmp_name.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
 
-        // get position
+        uint count = ids.size();
+        out.write((char *)&num_pinned, sizeof(num_pinned));
+        out.write((char *)&count, sizeof(count));
+        if (count > 0)
+            out.write((char *)ids.data(), count * sizeof(uint));
+        out.close();
 
-        unsigned long long cor_pos = beg + ((id - 1) * size_of_each_block);
+        rename(tmp_name.c_str(), getWarmUpFileName().c_str());
+    }
 
-        fout.seekp(cor_pos, fout.beg);
-        fout.write((char *)internal_memory[pos].block_buf, size_of_each_block);
-        fout.flush();
-        fout.close();
+    // reads the list written by saveWarmUpList; empty if there is none
+    std::vector<uint> loadWarmUpList(uint &num_pinned)
+    {
+        std::vector<uint> ids;
+        num_pinned = 0;
+
+        std::ifstream in(getWarmUpFileName().c_str(), std::ios::in | std::ios::binary);
+        uint count = 0;
+        if (!in.read((char *)&num_pinned, sizeof(num_pinned)) || !in.read((char *)&count, sizeof(count)))
+            return ids;
+
+        ids.resize(count);
+        if (count > 0 && !in.read((char *)ids.data(), count * sizeof(uint)))
+            ids.clear();
+        num_pinned = std::min(num_pinned, (uint)ids.size());
+        return ids;
+    }
 
-        num_writes++;
-#ifdef PROFILE
-        auto stop = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-        writeblock_time += duration.count();
-#endif
+    // makes a reused block look like a freshly allocated one, without reading
+    // the stale contents it has on disk
+    void clearReusedBlock(uint id)
+    {
+        if (mode == STORAGE_MMAP)
+        {
+            memset(mapping + blockOffset(id), 0, size_of_each_block);
+            return;
+        }
+
+        bool miss;
+        uint pos = OpenBlock(id, miss, true);
+        addDirtyNode(id);
+        pool->unpinFrame(pos);
+    }
+
+    // byte offset of a block inside the parent file
+    unsigned long long blockOffset(uint id)
+    {
+        return (unsigned long long)(id - 1) * size_of_each_block;
+    }
+
+    void noteWritten(uint id)
+    {
+        uint extent = written_extent.load();
+        while (id > extent && !written_extent.compare_exchange_weak(extent, id))
+            ;
+    }
+
+    void setLastOpen(uint id, uint pos)
+    {
+        last_open = ((unsigned long long)id << 32) | pos;
+    }
+
+    // called when block [id] leaves the pool, possibly by another thread
+    void forgetLastOpen(uint id)
+    {
+        unsigned long long last = last_open;
+        if ((uint)(last >> 32) == id)
+            last_open.compare_exchange_strong(last, 0);
+    }
+
+    // submits a batch of block requests, waits for all of them and clears it
+    void submitBatch(std::vector<IORequest> &reqs)
+    {
+        if (reqs.empty())
+            return;
+
+        io->submit(reqs.data(), reqs.size());
+        io->wait();
+
+        for (size_t i = 0; i < reqs.size(); i++)
+        {
+            // write-backs were counted by the owner of the evicted block
+            if (reqs[i].op == IO_READ)
+            {
+                assert(reqs[i].result >= 0);
+                num_reads++;
+            }
+            else
+            {
+                assert(reqs[i].result == (ssize_t)reqs[i].len);
+            }
+        }
+
+        reqs.clear();
     }
 
     void writeBlock(uint id, uint pos, bool dirty)
@@ -107,23 +320,17 @@ public:
 #ifdef PROFILE
         auto start = std::chrono::high_resolution_clock::now();
 #endif
-        if (pos >= blocks_in_memory_cap)
+        if (pos == BufferPool::NOT_RESIDENT)
             return;
 
         if (dirty)
         {
-
-            std::string filename = getParentFileName();
-
-            int fout = open(filename.c_str(), O_WRONLY, 0600);
-
-            assert(fout != -1);
-
             // get position
-            unsigned long long cor_pos = ((id - 1) * size_of_each_block);
+            unsigned long long cor_pos = blockOffset(id);
 
-            pwrite(fout, (char *)internal_memory[pos].block_buf, size_of_each_block, cor_pos);
-            close(fout);
+            ssize_t bytes_written = io->write(fd, (char *)pool->getFrame(pos)->block_buf, size_of_each_block, cor_pos);
+            assert(bytes_written == size_of_each_block);
+            noteWritten(id);
 
             num_writes++;
         }
@@ -139,16 +346,14 @@ public:
 #ifdef PROFILE
         auto start = std::chrono::high_resolution_clock::now();
 #endif
-        std::string filename = getParentFileName();
-        // std::ifstream fin(filename.c_str(), std::ios::binary | std::ios::in);
-        int fin = open(filename.c_str(), O_RDONLY);
-
         // get position
-        unsigned long long cor_pos = ((id - 1) * size_of_each_block);
+        unsigned long long cor_pos = blockOffset(id);
 
-        pread(fin, (char *)internal_memory[pos].block_buf, size_of_each_block, cor_pos);
+        // blocks that were allocated but never written lie past the end of
+        // the file and read back as zeros
+        ssize_t bytes_read = io->read(fd, (char *)pool->getFrame(pos)->block_buf, size_of_each_block, cor_pos);
+        assert(bytes_read >= 0);
 
-        close(fin);
         num_reads++;
 #ifdef PROFILE
         auto stop = std::chrono::high_resolution_clock::now();
@@ -158,116 +363,721 @@ public:
     }
 
 public:
+    // the manager takes ownership of _io. If no backend is given, plain
+    // pread/pwrite is used. If no pool is given, the manager creates a private
+    // one of _blocks_in_memory_cap frames; a shared pool must outlive the manager.
+    // With _reopen, the blocks an earlier manager left in the file are kept
+    // instead of truncating it, and so is its free list.
     BlockManager(std::string _name, std::string _root_dir,
-                 int _size_of_each_block, uint _blocks_in_memory_cap) : name(_name), root_dir(_root_dir), size_of_each_block(_size_of_each_block),
-                                                                        blocks_in_memory_cap(_blocks_in_memory_cap), current_blocks(0), num_reads(0), num_writes(0), leaf_cache_misses(0), internal_cache_misses(0), leaf_cache_hits(0), internal_cache_hits(0), total_cache_reqs(0), blocks_written(0)
+                 int _size_of_each_block, uint _blocks_in_memory_cap, IOBackend *_io = nullptr,
+                 StorageMode _mode = STORAGE_BUFFERED, BufferPool *_pool = nullptr, bool _reopen = false) : name(_name), root_dir(_root_dir), current_blocks(0), size_of_each_block(_size_of_each_block),
+                                                                                   blocks_in_memory_cap(_blocks_in_memory_cap), pool(_pool), owns_pool(false), pool_tag(0), io(_io), mode(_mode), mapping(nullptr), mapped_blocks(0), start_major_faults(0),
+                                                                                   last_open(0), blocks_written(0), num_reads(0), num_writes(0), foreground_writes(0), written_extent(0), warm_up_snapshot(false), mrc(nullptr),
+                                                                                   readahead_window(0), readahead_end(0), readahead_blocks(0), sealed_writes(0), leaf_cache_misses(0), internal_cache_misses(0), leaf_cache_hits(0), internal_cache_hits(0), total_cache_reqs(0)
     {
+        assert(size_of_each_block <= (int)sizeof(Block));
 #ifdef PROFLE
         openblock_time = 0;
         readblock_time = 0;
         writeblock_time = 0;
 #endif
-        internal_memory = new Block[blocks_in_memory_cap];
-
-        open_blocks = new LRUCache(blocks_in_memory_cap);
+        if (mode == STORAGE_BUFFERED)
+        {
+            if (pool == nullptr)
+            {
+                pool = new BufferPool(blocks_in_memory_cap);
+                owns_pool = true;
+            }
+            blocks_in_memory_cap = pool->getCapacity();
+            pool_tag = pool->registerOwner(this);
+        }
+        staging = new Block();
+        null_block = new Block();
+        memset(null_block->block_buf, 0, sizeof(null_block->block_buf));
 
         // leaf_cache_hits = 0;
         // internal_cache_hits = 0;
         // total_cache_reqs = 0;
 
+        if (io == nullptr)
+            io = new PosixIOBackend();
+
+        // create (or truncate) the parent file once and keep it open
         std::string filename = getParentFileName();
-        std::ofstream dummy_file(filename.c_str(), std::ios::out | std::ios::binary);
-        if (!dummy_file)
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | (_reopen ? 0 : O_TRUNC), 0600);
+        if (fd == -1)
         {
             std::cout << "Error in creating file!" << std::endl;
         }
-        dummy_file.flush();
-        assert(dummy_file.good());
-        dummy_file.close();
+        assert(fd != -1);
+
+        if (_reopen)
+        {
+            // every block that was flushed lies within the file
+            struct stat st;
+            int res = fstat(fd, &st);
+            assert(res == 0);
+            current_blocks = (st.st_size + size_of_each_block - 1) / size_of_each_block;
+            written_extent = current_blocks;
+            mapped_blocks = current_blocks;
+
+            loadFreeList();
+        }
+
+        if (mode == STORAGE_MMAP)
+        {
+            // reserve address space for the largest file we support up front,
+            // so that growing the file never moves blocks nodes point into.
+            // Only the part backed by the file may be touched.
+            void *addr = mmap(NULL, MMAP_RESERVE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+            assert(addr != MAP_FAILED);
+            mapping = (unsigned char *)addr;
+
+            // tree traversals jump around the file, readahead would be wasted
+            madvise(mapping, MMAP_RESERVE_BYTES, MADV_RANDOM);
+
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            start_major_faults = usage.ru_majflt;
+        }
     }
 
     ~BlockManager()
     {
-        // write all blocks back to disk
-        uint pos;
+        if (mode == STORAGE_MMAP)
+        {
+            flush();
+            munmap(mapping, MMAP_RESERVE_BYTES);
 
-        std::unordered_map<uint, Node*>::iterator it = open_blocks->getBegin();
-        std::unordered_map<uint, Node*>::iterator eit = open_blocks->getEnd();
-        for (; it != eit; ++it)
+            // drop the unused tail of the last growth step
+            int res = ftruncate(fd, blockOffset(current_blocks + 1));
+            assert(res == 0);
+        }
+        else
         {
-            pos = open_blocks->get(it->second->getId());
-            writeBlock(it->second->getId(), pos, true);
+            // write the modified blocks back to disk and hand the frames back to the pool
+            flush();
+            std::vector<uint> resident = pool->getResidentBlocks(pool_tag);
+            for (size_t i = 0; i < resident.size(); i++)
+                pool->release(pool_tag, resident[i]);
+
+            if (owns_pool)
+                delete pool;
         }
 
-        // delete
-        // delete[] internal_memory->block_buf;
-        delete[] internal_memory;
+        delete staging;
+        delete null_block;
+        delete mrc;
 
-        delete open_blocks;
+        close(fd);
+        delete io;
     }
 
-    // allocates a file (dummy) in the backup directory on disk and returns an id
-    // the id identifies the file, which would later be used as the node id
-    uint allocate()
+    /**
+     *  returns: id of the new block
+     *  Function: reuses a freed block if there is one and appends a block to
+     *  the file otherwise. [hint] is the id of a block the new one is going
+     *  to be scanned with, like the node it is split from: a free block within
+     *  ALLOC_EXTENT_BLOCKS after the hint is preferred, and if there is none
+     *  but the hint is the last block, appending keeps the two adjacent.
+     */
+    uint allocate(uint hint = 0)
     {
+        if (!free_blocks.empty())
+        {
+            std::set<uint>::iterator it = free_blocks.begin();
+            if (hint > 0)
+            {
+                std::set<uint>::iterator near = free_blocks.upper_bound(hint);
+                if (near != free_blocks.end() && *near - hint <= ALLOC_EXTENT_BLOCKS)
+                    it = near;
+                else if (hint == current_blocks)
+                    it = free_blocks.end();
+            }
+
+            if (it != free_blocks.end())
+            {
+                uint id = *it;
+                free_blocks.erase(it);
+                clearReusedBlock(id);
+                return id;
+            }
+        }
+
         uint id = ++current_blocks;
 
+        if (mode == STORAGE_MMAP && id > mapped_blocks)
+        {
+            // grow the file so the new block is backed by the mapping
+            assert(blockOffset(id + 1) <= MMAP_RESERVE_BYTES);
+            mapped_blocks += MMAP_GROW_BLOCKS;
+            int res = ftruncate(fd, blockOffset(mapped_blocks + 1));
+            assert(res == 0);
+        }
+
         return id;
     }
 
+    // returns block [id] to the free list. Its contents are dropped, even if
+    // they were never written.
     void deallocate(uint id)
     {
-        std::string filename = getBlockFileName(id);
-        assert(unlink(filename.c_str()) == 0);
+        assert(id > 0 && id <= current_blocks && free_blocks.count(id) == 0);
+
+        if (mode == STORAGE_BUFFERED)
+        {
+            pool->release(pool_tag, id);
+            forgetLastOpen(id);
+        }
+        if (mrc)
+            mrc->forget(id);
+        sealed_blocks.erase(std::remove(sealed_blocks.begin(), sealed_blocks.end(), id), sealed_blocks.end());
+
+        free_blocks.insert(id);
     }
 
-    uint OpenBlock(uint id, bool &miss)
+    uint getFreeBlocks() { return free_blocks.size(); }
+
+    /**
+     *  returns: number of blocks the file shrank by
+     *  Function: gives the space of free blocks back to the file system. Free
+     *  blocks at the end of the file are dropped and the file is truncated,
+     *  runs of free blocks inside the file are turned into holes. Live blocks
+     *  keep their ids, so nodes do not have to be rewritten.
+     */
+    uint compact()
+    {
+        uint old_blocks = current_blocks;
+        while (!free_blocks.empty() && *free_blocks.rbegin() == current_blocks)
+        {
+            free_blocks.erase(current_blocks);
+            current_blocks--;
+        }
+
+        if (written_extent > current_blocks)
+            written_extent = current_blocks;
+
+        if (mode == STORAGE_MMAP)
+        {
+            mapped_blocks = current_blocks;
+        }
+
+        int res = ftruncate(fd, blockOffset(current_blocks + 1));
+        assert(res == 0);
+
+        // punching holes is an optimization some file systems do not support
+        std::set<uint>::iterator it = free_blocks.begin();
+        while (it != free_blocks.end())
+        {
+            uint start = *it, len = 0;
+            while (it != free_blocks.end() && *it == start + len)
+            {
+                ++it;
+                len++;
+            }
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, blockOffset(start), (off_t)len * size_of_each_block);
+        }
+
+        saveFreeList();
+        return old_blocks - current_blocks;
+    }
+
+    // [fresh] blocks were just allocated and are zero-filled instead of read.
+    // The returned frame is in use by the caller (see BufferPool::lookup),
+    // [frame_node] receives its descriptor.
+    uint OpenBlock(uint id, bool &miss, bool fresh = false, Node **frame_node = nullptr)
     {
 #ifdef PROFILE
         auto start = std::chrono::high_resolution_clock::now();
 #endif
-        uint pos = open_blocks->get(id);
+        uint pos = pool->lookup(pool_tag, id, frame_node);
 
         total_cache_reqs += 1;
 
-        if (pos < blocks_in_memory_cap)
+        if (pos != BufferPool::NOT_RESIDENT)
         {
             // block is already open in memory
             miss = false;
+            setLastOpen(id, pos);
             return pos;
         }
 
-        miss = true;
-        uint evicted_id;
-        pos = open_blocks->put(id, &evicted_id);
+        // the evicted block may belong to another manager sharing the pool,
+        // write_back then points to that manager's file
+        IORequest write_back;
+        bool needs_write_back;
+        pos = pool->admit(pool_tag, id, write_back, needs_write_back, miss, frame_node);
 
-        // write old block back to disk
-        if (evicted_id > 0)
+        // another thread brought the block in meanwhile
+        if (!miss)
         {
-            // find if evicted id is in dirty nodes
-            // auto it = std::find(dirty_nodes.begin(), dirty_nodes.end(), evicted_id);
-            auto it = dirty_nodes.find(evicted_id);
-            if (it != dirty_nodes.end())
+            setLastOpen(id, pos);
+            return pos;
+        }
+
+        Block *frame = pool->getFrame(pos);
+        bool on_disk = !fresh && id <= written_extent;
+
+        if (needs_write_back && io->isAsync() && on_disk)
+        {
+            std::lock_guard<std::mutex> guard(io_latch);
+
+            // overlap the write-back of the evicted block with the read of the
+            // requested one. The evicted contents are staged first so that the
+            // frame can be refilled while the write is still in flight.
+            memcpy(staging->block_buf, frame->block_buf, size_of_each_block);
+            memset(frame->block_buf, 0, sizeof(frame->block_buf));
+
+            write_back.buf = staging->block_buf;
+            IORequest reqs[2] = {write_back,
+                                 IORequest(IO_READ, fd, frame->block_buf, size_of_each_block, blockOffset(id))};
+            io->submit(reqs, 2);
+            io->wait();
+
+            assert(reqs[0].result == size_of_each_block);
+            assert(reqs[1].result >= 0);
+            num_reads++;
+        }
+        else
+        {
+            // write old block back to disk
+            if (needs_write_back)
             {
-                // write block if dirty
-                writeBlock(evicted_id, pos, true);
-                // dirty_nodes.remove(evicted_id);
-                dirty_nodes.erase(evicted_id);
+                ssize_t bytes_written = io->write(write_back.fd, frame->block_buf, write_back.len, write_back.offset);
+                assert(bytes_written == (ssize_t)write_back.len);
             }
-        }
 
-        // read new block from disk into memory at pos
-        memset(internal_memory[pos].block_buf, 0, sizeof(internal_memory[pos].block_buf));
-        readBlock(id, pos);
+            // read new block from disk into memory at pos
+            memset(frame->block_buf, 0, sizeof(frame->block_buf));
+            if (on_disk)
+                readBlock(id, pos);
+        }
+        pool->finishLoad(pos);
 #ifdef PROFILE
         auto stop = std::chrono::high_resolution_clock::now();
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
         openblock_time += duration.count();
 #endif
 
+        setLastOpen(id, pos);
         return pos;
     }
 
+    /**
+     *  returns: the memory holding block [id]
+     *  Function: makes the block accessible. In STORAGE_BUFFERED mode this goes
+     *  through the cache (see OpenBlock), in STORAGE_MMAP mode the block is
+     *  used in place inside the mapping of the tree file.
+     */
+    Block *getBlock(uint id, bool &miss)
+    {
+        if (mode == STORAGE_MMAP)
+        {
+            total_cache_reqs += 1;
+
+            // residency is up to the kernel, see getMajorFaults()
+            miss = false;
+            if (id == 0 || id > mapped_blocks)
+                return null_block;
+            return (Block *)(mapping + blockOffset(id));
+        }
+
+        if (id == 0)
+        {
+            miss = false;
+            return null_block;
+        }
+
+        // the caller's pin scope may hold the block already
+        if (BufferPool::inPinScope())
+        {
+            uint kept = pool->findKeptFrame(pool_tag, id);
+            if (kept != BufferPool::NOT_RESIDENT)
+            {
+                total_cache_reqs += 1;
+                miss = false;
+                setLastOpen(id, kept);
+                return pool->getFrame(kept);
+            }
+        }
+
+        // the frame stays in use until the caller's pin scope ends
+        Node *frame_node;
+        uint pos = OpenBlock(id, miss, false, &frame_node);
+        pool->keepFrame(pool_tag, id, pos, frame_node);
+        return pool->getFrame(pos);
+    }
+
+    /**
+     *  returns: the memory holding block [id]
+     *  Function: like getBlock, but the frame stays in use, and so in place,
+     *  until releaseBlock([frame_node]) instead of until the pin scope ends.
+     *  [frame_node] is nullptr if there is nothing to release (block id 0 and
+     *  STORAGE_MMAP mode, where blocks never move).
+     */
+    Block *acquireBlock(uint id, bool &miss, Node *&frame_node)
+    {
+        frame_node = nullptr;
+        if (mode == STORAGE_MMAP || id == 0)
+            return getBlock(id, miss);
+
+        // a frame the pin scope keeps is resident, so it takes no lookup
+        if (BufferPool::inPinScope())
+        {
+            uint kept = pool->findKeptFrame(pool_tag, id, &frame_node);
+            if (kept != BufferPool::NOT_RESIDENT)
+            {
+                LRUCache::acquire(frame_node);
+                total_cache_reqs += 1;
+                miss = false;
+                setLastOpen(id, kept);
+                return pool->getFrame(kept);
+            }
+        }
+
+        uint pos = OpenBlock(id, miss, false, &frame_node);
+        return pool->getFrame(pos);
+    }
+
+    // ends the use of a frame begun by acquireBlock
+    void releaseBlock(Node *frame_node)
+    {
+        if (frame_node)
+            LRUCache::release(frame_node);
+    }
+
+    /**
+     *  returns: the memory holding block [child_id]
+     *  Function: like acquireBlock, for the child in [slot] of a block held
+     *  in [parent_frame]. With pointer swizzling on, the parent's frame keeps
+     *  a reference to the child's frame once the child is resident, and later
+     *  walks follow it without a lookup in the pool.
+     */
+    Block *acquireChild(Node *parent_frame, uint slot, uint child_id, bool &miss, Node *&child_frame)
+    {
+        if (parent_frame == nullptr || mode == STORAGE_MMAP || !pool->isSwizzling())
+            return acquireBlock(child_id, miss, child_frame);
+
+        uint pos = pool->followChild(parent_frame, slot, pool_tag, child_id, &child_frame);
+        if (pos != BufferPool::NOT_RESIDENT)
+        {
+            total_cache_reqs += 1;
+            miss = false;
+            setLastOpen(child_id, pos);
+            return pool->getFrame(pos);
+        }
+
+        Block *block = acquireBlock(child_id, miss, child_frame);
+        if (child_frame)
+            pool->swizzleChild(parent_frame, slot, child_frame);
+        return block;
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: writes every modified block back to the tree file. In
+     *  STORAGE_MMAP mode the mapping is synced with msync.
+     */
+    void flush()
+    {
+        saveFreeList();
+
+        if (mode == STORAGE_MMAP)
+        {
+            if (mapped_blocks > 0)
+                msync(mapping, blockOffset(mapped_blocks + 1), MS_SYNC);
+            return;
+        }
+
+        std::vector<std::pair<uint, uint>> blocks = pool->takeDirtyBlocks(pool_tag);
+        writeRuns(blocks);
+        for (size_t i = 0; i < blocks.size(); i++)
+            pool->unpinFrame(blocks[i].second);
+        sealed_blocks.clear();
+
+        if (warm_up_snapshot)
+            saveWarmUpList();
+    }
+
+    // with [enable], every flush (including the one at destruction) saves the
+    // ids of the resident blocks next to the tree file ("<tree>.warm")
+    void setWarmUpSnapshot(bool enable) { warm_up_snapshot = enable; }
+
+    /**
+     *  returns: number of blocks read
+     *  Function: loads the blocks listed by the last warm-up snapshot back into
+     *  the pool, as many of the hottest ones as fit into it. Their frames are
+     *  handed to the replacement policy from the coldest to the hottest block,
+     *  so the recency order is the one that was saved, and blocks that were
+     *  pinned are pinned again. The reads themselves are sorted by block id
+     *  and issued as one preadv per run of consecutive blocks.
+     */
+    uint warmUp()
+    {
+        if (mode == STORAGE_MMAP)
+            return 0;
+
+        uint num_pinned;
+        std::vector<uint> ids = loadWarmUpList(num_pinned);
+        if (ids.size() > pool->getCapacity())
+            ids.resize(pool->getCapacity());
+
+        std::vector<std::pair<uint, uint>> blocks;
+        for (size_t i = ids.size(); i-- > 0;)
+        {
+            uint id = ids[i];
+            if (id == 0 || id > written_extent || free_blocks.count(id) > 0 || pool->contains(pool_tag, id))
+                continue;
+
+            IORequest write_back;
+            bool needs_write_back, needs_load;
+            uint pos = pool->admit(pool_tag, id, write_back, needs_write_back, needs_load);
+            if (needs_write_back)
+            {
+                // the write-back must land before the frame is overwritten
+                ssize_t bytes_written = io->write(write_back.fd, pool->getFrame(pos)->block_buf, write_back.len, write_back.offset);
+                assert(bytes_written == (ssize_t)write_back.len);
+            }
+            if (!needs_load)
+            {
+                pool->unpinFrame(pos);
+                continue;
+            }
+            memset(pool->getFrame(pos)->block_buf, 0, size_of_each_block);
+            blocks.push_back(std::make_pair(id, pos));
+        }
+
+        readRuns(blocks);
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            pool->finishLoad(blocks[i].second);
+            pool->unpinFrame(blocks[i].second);
+        }
+
+        for (uint i = 0; i < num_pinned && i < ids.size(); i++)
+            pinBlock(ids[i]);
+
+        return blocks.size();
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: tells the manager that block [id] is complete and will not
+     *  change anymore, like a leaf the sorted tree has split off its tail.
+     *  Sealed blocks are collected and written SEAL_BATCH_BLOCKS at a time in
+     *  block id order, which makes them sequential writes for blocks allocated
+     *  in order. Once written, they are clean and moved to the cold end of the
+     *  LRU order, so they are evicted first and without a write-back. A sealed
+     *  block that is modified after all just becomes dirty again.
+     */
+    void sealBlock(uint id)
+    {
+        // the kernel writes back the pages of the mapping
+        if (mode == STORAGE_MMAP)
+            return;
+
+        sealed_blocks.push_back(id);
+        if (sealed_blocks.size() < SEAL_BATCH_BLOCKS)
+            return;
+
+        std::vector<std::pair<uint, uint>> blocks;
+        for (size_t i = 0; i < sealed_blocks.size(); i++)
+        {
+            uint pos = pool->takeDirtyBlock(pool_tag, sealed_blocks[i]);
+            if (pos != BufferPool::NOT_RESIDENT)
+                blocks.push_back(std::make_pair(sealed_blocks[i], pos));
+        }
+        writeRuns(blocks);
+        sealed_writes += blocks.size();
+        for (size_t i = 0; i < blocks.size(); i++)
+            pool->unpinFrame(blocks[i].second);
+
+        for (size_t i = 0; i < sealed_blocks.size(); i++)
+            pool->demote(pool_tag, sealed_blocks[i]);
+        sealed_blocks.clear();
+    }
+
+    unsigned long long getSealedWrites() { return sealed_writes; }
+
+    // writes (block id, frame position) pairs sorted by block id, with one
+    // pwritev per run of consecutive block ids
+    void writeRuns(std::vector<std::pair<uint, uint>> &blocks)
+    {
+        std::sort(blocks.begin(), blocks.end());
+
+        std::vector<struct iovec> iov;
+        iov.reserve(std::min(blocks.size(), (size_t)IOV_MAX));
+
+        size_t run_start = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            struct iovec v;
+            v.iov_base = pool->getFrame(blocks[i].second)->block_buf;
+            v.iov_len = size_of_each_block;
+            iov.push_back(v);
+
+            bool run_ends = i + 1 == blocks.size() || blocks[i + 1].first != blocks[i].first + 1 || iov.size() == IOV_MAX;
+            if (run_ends)
+            {
+                ssize_t bytes_written = io->writev(fd, iov.data(), iov.size(), blockOffset(blocks[run_start].first));
+                assert(bytes_written == (ssize_t)(iov.size() * size_of_each_block));
+                noteWritten(blocks[i].first);
+
+                num_writes += iov.size();
+                iov.clear();
+                run_start = i + 1;
+            }
+        }
+    }
+
+    // reads (block id, frame position) pairs sorted by block id, with one
+    // preadv per run of consecutive block ids
+    void readRuns(std::vector<std::pair<uint, uint>> &blocks)
+    {
+        std::sort(blocks.begin(), blocks.end());
+
+        std::vector<struct iovec> iov;
+        iov.reserve(std::min(blocks.size(), (size_t)IOV_MAX));
+
+        size_t run_start = 0;
+        for (size_t i = 0; i < blocks.size(); i++)
+        {
+            struct iovec v;
+            v.iov_base = pool->getFrame(blocks[i].second)->block_buf;
+            v.iov_len = size_of_each_block;
+            iov.push_back(v);
+
+            bool run_ends = i + 1 == blocks.size() || blocks[i + 1].first != blocks[i].first + 1 || iov.size() == IOV_MAX;
+            if (run_ends)
+            {
+                ssize_t bytes_read = io->readv(fd, iov.data(), iov.size(), blockOffset(blocks[run_start].first));
+                assert(bytes_read >= 0);
+
+                num_reads += iov.size();
+                iov.clear();
+                run_start = i + 1;
+            }
+        }
+    }
+
+    /**
+     *  returns: number of blocks read
+     *  Function: brings every listed block that is not in memory yet into the
+     *  cache. The reads, together with the write-backs of the dirty blocks they
+     *  evict, are handed to the I/O backend as a single batch.
+     */
+    uint prefetch(const std::vector<uint> &ids)
+    {
+        if (mode == STORAGE_MMAP)
+        {
+            // let the kernel start reading the pages in the background
+            for (size_t i = 0; i < ids.size(); i++)
+            {
+                if (ids[i] > 0 && ids[i] <= current_blocks)
+                    madvise(mapping + blockOffset(ids[i]), size_of_each_block, MADV_WILLNEED);
+            }
+            return 0;
+        }
+
+        std::vector<IORequest> reqs;
+        reqs.reserve(2 * ids.size());
+
+        // evicted dirty blocks are staged so their frames can be reused at once
+        std::vector<Block> write_staging;
+        write_staging.reserve(ids.size());
+
+        // frames filled by the batch; they stay in use until it completes,
+        // so the batch never recycles one of its own frames
+        std::vector<uint> batch_positions;
+
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            uint id = ids[i];
+            if (id == 0 || id > written_extent || pool->contains(pool_tag, id))
+                continue;
+
+            IORequest write_back;
+            bool needs_write_back, needs_load;
+            uint pos = pool->admit(pool_tag, id, write_back, needs_write_back, needs_load);
+            if (!needs_load)
+            {
+                pool->unpinFrame(pos);
+                continue;
+            }
+            Block *frame = pool->getFrame(pos);
+            batch_positions.push_back(pos);
+
+            if (needs_write_back)
+            {
+                write_staging.push_back(*frame);
+                write_back.buf = write_staging.back().block_buf;
+                reqs.push_back(write_back);
+            }
+
+            memset(frame->block_buf, 0, sizeof(frame->block_buf));
+            reqs.push_back(IORequest(IO_READ, fd, frame->block_buf, size_of_each_block, blockOffset(id)));
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(io_latch);
+            submitBatch(reqs);
+        }
+
+        for (size_t i = 0; i < batch_positions.size(); i++)
+        {
+            pool->finishLoad(batch_positions[i]);
+            pool->unpinFrame(batch_positions[i]);
+        }
+
+        return batch_positions.size();
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: called by scans that follow the leaf chain from block [from]
+     *  to block [to]. Leaves are mostly allocated in key order, so as long as
+     *  the scan moves forward in small steps, the blocks ahead of it are
+     *  prefetched as one batch. The window starts at READAHEAD_MIN_BLOCKS and
+     *  doubles every time the scan gets halfway through it, up to
+     *  READAHEAD_MAX_BLOCKS and a quarter of the pool; any other hop resets it.
+     */
+    void followLeafChain(uint from, uint to)
+    {
+        std::lock_guard<std::mutex> guard(readahead_latch);
+
+        if (to <= from || to - from > READAHEAD_MAX_GAP)
+        {
+            readahead_window = 0;
+            readahead_end = 0;
+            return;
+        }
+
+        // a new scan started before the current window
+        if (to + readahead_window < readahead_end)
+        {
+            readahead_window = 0;
+            readahead_end = 0;
+        }
+
+        // still well inside the window that was read ahead
+        if (to + readahead_window / 2 < readahead_end)
+            return;
+
+        uint max_window = READAHEAD_MAX_BLOCKS;
+        if (mode == STORAGE_BUFFERED)
+            max_window = std::max(1u, std::min(max_window, pool->getCapacity() / 4));
+        readahead_window = std::min(max_window, readahead_window == 0 ? READAHEAD_MIN_BLOCKS : 2 * readahead_window);
+
+        std::vector<uint> ids;
+        for (uint id = std::max(to, readahead_end); id < to + readahead_window; id++)
+            ids.push_back(id);
+        readahead_end = to + readahead_window;
+
+        readahead_blocks += prefetch(ids);
+    }
+
+    unsigned long long getReadaheadBlocks() { return readahead_blocks; }
+
     void setLeafCacheMisses(unsigned long long counter)
     {
         leaf_cache_misses = counter;
@@ -308,6 +1118,25 @@ public:
         internal_cache_hits++;
     }
 
+    // samples about [rate] of the blocks to estimate the miss ratio curve of
+    // the tree (see MissRatioCurve); 0 turns the estimation off. Not to be
+    // called while other threads use the tree.
+    void setMissRatioSampling(double rate)
+    {
+        delete mrc;
+        mrc = rate > 0 ? new MissRatioCurve(rate) : nullptr;
+    }
+
+    // notes an access of the tree to block [id] for the miss ratio curve
+    void recordAccess(uint id, bool is_leaf)
+    {
+        if (mrc)
+            mrc->access(id, is_leaf);
+    }
+
+    // nullptr if the estimation is off
+    MissRatioCurve *getMissRatioCurve() { return mrc; }
+
     unsigned long long getLeafCacheMisses() { return leaf_cache_misses; }
 
     unsigned long long getInternalCacheMisses() { return internal_cache_misses; }
@@ -320,10 +1149,93 @@ public:
 
     uint getCurrentBlocks() { return current_blocks; }
 
+    // major page faults taken since the manager was created. In STORAGE_MMAP
+    // mode this stands in for the cache misses of the buffered mode (note that
+    // the counter is per process, not per tree).
+    long getMajorFaults()
+    {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_majflt - start_major_faults;
+    }
+
+    bool evictBlock(uint id, bool dirty, IORequest &write_back)
+    {
+        forgetLastOpen(id);
+
+        if (!dirty)
+            return false;
+
+        num_writes++;
+        foreground_writes++;
+
+        getWriteBack(id, write_back);
+        return true;
+    }
+
+    void getWriteBack(uint id, IORequest &write_back)
+    {
+        noteWritten(id);
+        write_back = IORequest(IO_WRITE, fd, nullptr, size_of_each_block, blockOffset(id));
+    }
+
+    unsigned long long getForegroundWrites() { return foreground_writes; }
+
+    // blocks of this manager written by the pool's background writer
+    unsigned long long getBackgroundWrites() { return mode == STORAGE_MMAP ? 0 : pool->getBackgroundWrites(pool_tag); }
+
+    void writeBack(IORequest &write_back, Block *frame)
+    {
+        ssize_t bytes_written = io->write(write_back.fd, (char *)frame->block_buf, write_back.len, write_back.offset);
+        assert(bytes_written == (ssize_t)write_back.len);
+    }
+
+    // number of frames of the (possibly shared) pool
+    uint getCacheCapacity() { return mode == STORAGE_MMAP ? blocks_in_memory_cap : pool->getCapacity(); }
+
+    // resizes the pool; see BufferPool::setCapacity. No block of the pool may
+    // be in use while this runs.
+    void setCacheCapacity(uint cap)
+    {
+        blocks_in_memory_cap = cap;
+        if (mode != STORAGE_MMAP)
+            pool->setCapacity(cap);
+    }
+
+    /**
+     *  returns: false if the block could not be pinned
+     *  Function: keeps block [id] in the buffer pool, whatever the replacement
+     *  policy would evict, as long as the pool's pin quota allows it (see
+     *  BufferPool::setPinFraction). Meant for the few blocks every operation
+     *  touches, like the internal nodes of a tree. The block has to be open.
+     */
+    bool pinBlock(uint id)
+    {
+        if (mode == STORAGE_MMAP || id == 0)
+            return false;
+        return pool->pin(pool_tag, id);
+    }
+
+    // lets the replacement policy evict block [id] again
+    void unpinBlock(uint id)
+    {
+        if (mode != STORAGE_MMAP && id != 0)
+            pool->unpin(pool_tag, id);
+    }
+
+    // number of frames of the buffer pool currently holding blocks of this manager
+    uint getResidentBlocks() { return mode == STORAGE_MMAP ? 0 : pool->getOwnerFrames(pool_tag); }
+
     void addDirtyNode(uint nodeId)
     {
+        // the kernel tracks dirty pages of the mapping itself
+        if (mode == STORAGE_MMAP)
+            return;
 
-        dirty_nodes.insert({nodeId, nodeId});
+        unsigned long long last = last_open;
+        uint pos = (uint)(last >> 32) == nodeId ? (uint)last : pool->find(pool_tag, nodeId);
+        if (pos != BufferPool::NOT_RESIDENT)
+            pool->markDirty(pos);
     }
 };
 
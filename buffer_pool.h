@@ -0,0 +1,1162 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstdint>
+#include <cassert>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "lru_cache.h"
+#include "io_backend.h"
+
+// size of a frame, and so the largest block a manager can use; the block
+// size knob of the trees is defined by it
+#define BLOCK_SIZE_BYTES 4096
+
+// frames are allocated in chunks of this many blocks (2 MB, one huge page)
+#define POOL_CHUNK_FRAMES 512
+
+// most blocks the background writer cleans per round
+#define WRITEBACK_BATCH 64
+
+// the pool is split into up to POOL_SHARDS shards (a power of two), as long
+// as every shard gets at least POOL_MIN_SHARD_FRAMES frames
+#define POOL_SHARDS 8
+#define POOL_MIN_SHARD_FRAMES 256
+
+// number of the most recently kept frames of a pin scope checked before a
+// block is looked up in the pool, see BufferPool::findKeptFrame
+#define POOL_SCOPE_PROBE 8
+
+// size of the chunk table, which bounds the pool at 64 GB of frames
+#define POOL_MAX_CHUNKS 32768
+
+class Block
+{
+public:
+    unsigned char block_buf[BLOCK_SIZE_BYTES];
+};
+
+// Implemented by everything that keeps blocks in a BufferPool (the block
+// managers). The pool calls back into the owner of a block before handing
+// the block's frame to someone else.
+class BufferPoolOwner
+{
+public:
+    virtual ~BufferPoolOwner() {}
+
+    /**
+     *  returns: true if the block has to be written back before its frame is reused
+     *  Function: notifies the owner that block [id] leaves the pool. If the
+     *  block is [dirty], the owner fills in fd, len and offset of write_back;
+     *  the caller supplies the buffer and performs the write.
+     */
+    virtual bool evictBlock(uint id, bool dirty, IORequest &write_back) = 0;
+
+    // fills in fd, len and offset of a write of block [id]
+    virtual void getWriteBack(uint id, IORequest &write_back) = 0;
+
+    // writes [frame] as described by a request filled in by evictBlock()
+    virtual void writeBack(IORequest &write_back, Block *frame) = 0;
+};
+
+// Latch that lets any number of readers or a single writer in.
+class RWLatch
+{
+    std::mutex latch;
+    std::condition_variable cv;
+
+    // number of readers inside, -1 while a writer is
+    int state;
+
+    // writers waiting to get in; new readers queue up behind them
+    uint waiting_writers;
+
+public:
+    RWLatch() : state(0), waiting_writers(0) {}
+
+    void lockShared()
+    {
+        std::unique_lock<std::mutex> lock(latch);
+        cv.wait(lock, [this] { return state >= 0 && waiting_writers == 0; });
+        state++;
+    }
+
+    void unlockShared()
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        if (--state == 0)
+            cv.notify_all();
+    }
+
+    void lock()
+    {
+        std::unique_lock<std::mutex> lock(latch);
+        waiting_writers++;
+        cv.wait(lock, [this] { return state == 0; });
+        waiting_writers--;
+        state = -1;
+    }
+
+    void unlock()
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        state = 0;
+        cv.notify_all();
+    }
+};
+
+// holds an RWLatch shared or exclusive for the lifetime of the guard
+class RWLatchGuard
+{
+    RWLatch &latch;
+    bool exclusive;
+
+public:
+    RWLatchGuard(RWLatch &_latch, bool _exclusive) : latch(_latch), exclusive(_exclusive)
+    {
+        if (exclusive)
+            latch.lock();
+        else
+            latch.lockShared();
+    }
+
+    ~RWLatchGuard()
+    {
+        if (exclusive)
+            latch.unlock();
+        else
+            latch.unlockShared();
+    }
+};
+
+// A budget of block frames shared by any number of block managers. Frames
+// move between owners as they are evicted, so whichever owner is accessed
+// most holds most of the frames. Frame memory is allocated in chunks of
+// POOL_CHUNK_FRAMES on first use, and the budget can be changed at runtime.
+//
+// The pool is split into shards by block, each with its own latch, cache and
+// share of the capacity, so threads working on different blocks rarely wait
+// for each other. lookup() and admit() hand out frames that are in use until
+// unpinFrame() is called; frames in use are never evicted, and a shard whose
+// frames are all in use grows past its share instead.
+class BufferPool
+{
+    // one partition of the pool. The frames of shard s are at positions s,
+    // s + num_shards, s + 2 * num_shards, ...
+    struct Shard
+    {
+        uint index;
+
+        std::mutex latch;
+
+        // signalled when a read or write of a frame of the shard completes
+        std::condition_variable frame_cv;
+
+        // maps (owner, block id) to a position inside the shard
+        LRUCache *cache;
+
+        uint capacity;
+        uint pin_capacity;
+
+        // evicted blocks whose write-back is still running, and the frame
+        // that is refilled after it. The blocks cannot be read back until then.
+        std::vector<std::pair<cache_key, uint>> writing;
+
+        // number of frames every owner holds in the shard, and blocks of
+        // every owner written by the background writer
+        std::vector<uint> owner_frames;
+        std::vector<unsigned long long> background_writes;
+    };
+
+    struct ScopeFrame
+    {
+        BufferPool *pool;
+        cache_key key;
+        uint pos;
+        Node *node;
+    };
+
+    // frames in use by the pin scope of the calling thread, see beginPinScope
+    struct PinScope
+    {
+        uint depth;
+        std::vector<ScopeFrame> frames;
+
+        PinScope() : depth(0) {}
+    };
+
+    static PinScope &threadPinScope()
+    {
+        static thread_local PinScope scope;
+        return scope;
+    }
+
+    // allocates one chunk of frames, with huge pages if asked for
+    Block *allocateChunk()
+    {
+        size_t bytes = POOL_CHUNK_FRAMES * sizeof(Block);
+        void *mem = MAP_FAILED;
+
+        if (huge_pages)
+        {
+            // explicitly reserved huge pages first
+            mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+            if (mem == MAP_FAILED)
+            {
+                // otherwise ask for transparent huge pages, which need the
+                // chunk to be aligned to the huge page size
+                void *raw = mmap(NULL, 2 * bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                assert(raw != MAP_FAILED);
+
+                uintptr_t start = ((uintptr_t)raw + bytes - 1) & ~(uintptr_t)(bytes - 1);
+                if (start > (uintptr_t)raw)
+                    munmap(raw, start - (uintptr_t)raw);
+                munmap((void *)(start + bytes), (uintptr_t)raw + bytes - start);
+
+                mem = (void *)start;
+                madvise(mem, bytes, MADV_HUGEPAGE);
+            }
+        }
+        else
+        {
+            mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+
+        assert(mem != MAP_FAILED);
+        return (Block *)mem;
+    }
+
+    // maximum number of frames in use (a shard only goes beyond its share
+    // while all of its frames are in use)
+    uint capacity;
+
+    // share of the capacity pinned blocks may take. The rest of the pool is
+    // managed by the replacement policy.
+    float pin_frac;
+
+    uint num_shards;
+    uint shard_bits;
+    std::vector<Shard *> shards;
+
+    // frame memory; chunk i holds frames [i * POOL_CHUNK_FRAMES, (i + 1) * POOL_CHUNK_FRAMES).
+    // The table has a fixed size, so frames are found without a latch while
+    // other threads add chunks.
+    std::atomic<Block *> *chunks;
+    std::mutex chunk_latch;
+
+    // back chunks with huge pages if possible
+    bool huge_pages;
+
+    std::vector<BufferPoolOwner *> owners;
+
+    // number of dirty frames in all shards
+    std::atomic<uint> num_dirty;
+
+    // wakes up the background writer
+    std::mutex writeback_latch;
+    std::condition_variable writeback_cv;
+
+    std::thread writeback_thread;
+    std::atomic<bool> writeback_running;
+    std::atomic<bool> stop_writeback;
+
+    // the writer starts once high_watermark frames are dirty and cleans down
+    // to low_watermark
+    std::atomic<uint> high_watermark;
+    std::atomic<uint> low_watermark;
+
+    // number of child references kept per frame for pointer swizzling, 0 if
+    // it is off
+    uint swizzle_slots;
+
+    // pools too small to give every shard POOL_MIN_SHARD_FRAMES use fewer shards
+    static uint shardBits(uint cap)
+    {
+        uint bits = 0;
+        while ((1u << (bits + 1)) <= POOL_SHARDS && cap >> (bits + 1) >= POOL_MIN_SHARD_FRAMES)
+            bits++;
+        return bits;
+    }
+
+    Shard &shardOf(cache_key key)
+    {
+        if (shard_bits == 0)
+            return *shards[0];
+        return *shards[(key * 0x9E3779B97F4A7C15ULL) >> (64 - shard_bits)];
+    }
+
+    Shard &shardOfFrame(uint pos) { return *shards[pos % num_shards]; }
+
+    uint framePos(Shard &shard, uint local) { return local * num_shards + shard.index; }
+
+    // descriptor of the frame at [pos]
+    Node *frameNode(uint pos) { return shardOfFrame(pos).cache->getNode(pos / num_shards); }
+
+    uint shardCapacity(uint cap, uint index) { return cap / num_shards + (index < cap % num_shards ? 1 : 0); }
+
+    uint pinQuota(uint cap)
+    {
+        return std::min((uint)(cap * pin_frac), cap > 0 ? cap - 1 : 0);
+    }
+
+    void ensureChunk(uint pos)
+    {
+        uint chunk = pos / POOL_CHUNK_FRAMES;
+        assert(chunk < POOL_MAX_CHUNKS);
+        if (chunks[chunk].load(std::memory_order_acquire) != nullptr)
+            return;
+
+        std::lock_guard<std::mutex> guard(chunk_latch);
+        if (chunks[chunk].load(std::memory_order_relaxed) == nullptr)
+            chunks[chunk].store(allocateChunk(), std::memory_order_release);
+    }
+
+    // hands pinned blocks of the shard back to the policy until they fit its quota
+    void unpinExcess(Shard &shard)
+    {
+        for (uint local = 0; local < shard.cache->getPositions() && shard.cache->getNumPinned() > shard.pin_capacity; local++)
+        {
+            Node *node = shard.cache->getNode(local);
+            if (node->id != 0 && node->pinned)
+                shard.cache->unpin(node->id);
+        }
+    }
+
+    // drops the child references of a frame whose block leaves it
+    void unswizzle(Node *node)
+    {
+        std::atomic<Node *> *refs = node->swizzled.load(std::memory_order_relaxed);
+        if (refs == nullptr)
+            return;
+        for (uint i = 0; i < swizzle_slots; i++)
+            refs[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    // waits until no read or write of the frame is running
+    void waitForFrame(std::unique_lock<std::mutex> &lock, Shard &shard, Node *node)
+    {
+        while (node->in_flight)
+            shard.frame_cv.wait(lock);
+    }
+
+    static bool isBeingWritten(Shard &shard, cache_key key)
+    {
+        for (size_t i = 0; i < shard.writing.size(); i++)
+        {
+            if (shard.writing[i].first == key)
+                return true;
+        }
+        return false;
+    }
+
+    // waits until the write-back of the evicted block [key] is done
+    void waitForWriteBack(std::unique_lock<std::mutex> &lock, Shard &shard, cache_key key)
+    {
+        while (isBeingWritten(shard, key))
+            shard.frame_cv.wait(lock);
+    }
+
+    void setDirty(Node *node, bool is_dirty)
+    {
+        if (node->dirty == is_dirty)
+            return;
+
+        node->dirty = is_dirty;
+        if (is_dirty)
+        {
+            if (num_dirty.fetch_add(1) + 1 == high_watermark && writeback_running)
+                writeback_cv.notify_one();
+        }
+        else
+        {
+            num_dirty--;
+        }
+    }
+
+    // evicts blocks of a shard that grew past its share while all of its
+    // frames were in use, writing them back on the spot
+    void shrinkShard(std::unique_lock<std::mutex> &lock, Shard &shard, bool release_memory)
+    {
+        cache_key evicted_key;
+        uint local;
+        while (shard.cache->getSize() > shard.capacity && shard.cache->evict(&evicted_key, &local))
+        {
+            Node *node = shard.cache->getNode(local);
+            uint evicted_tag = evicted_key >> 32;
+            shard.owner_frames[evicted_tag]--;
+            waitForFrame(lock, shard, node);
+            unswizzle(node);
+
+            IORequest write_back;
+            if (owners[evicted_tag]->evictBlock((uint)evicted_key, node->dirty, write_back))
+                owners[evicted_tag]->writeBack(write_back, getFrame(framePos(shard, local)));
+            setDirty(node, false);
+
+            if (release_memory)
+                madvise(getFrame(framePos(shard, local)), sizeof(Block), MADV_DONTNEED);
+        }
+    }
+
+    // a write of the background writer: block of owner [tag] in the frame
+    // at [local] of its shard
+    struct BackgroundWrite
+    {
+        uint tag;
+        uint local;
+        IORequest write;
+    };
+
+    /**
+     *  returns: N/A
+     *  Function: body of the background writer. Sleeps until the dirty frames
+     *  reach the high watermark, then writes out dirty blocks from the cold
+     *  end of the LRU order of every shard until the low watermark is reached,
+     *  so that evictions in the foreground mostly find clean frames. Only the
+     *  coldest quarter of a shard is considered; blocks that are in use are hot.
+     */
+    void writeBackLoop()
+    {
+        while (!stop_writeback)
+        {
+            {
+                std::unique_lock<std::mutex> lock(writeback_latch);
+                writeback_cv.wait_for(lock, std::chrono::milliseconds(100),
+                                      [this] { return stop_writeback || num_dirty >= high_watermark; });
+            }
+
+            while (!stop_writeback && num_dirty > low_watermark)
+            {
+                uint written = 0;
+                for (uint s = 0; s < num_shards && !stop_writeback && num_dirty > low_watermark; s++)
+                {
+                    Shard &shard = *shards[s];
+                    std::vector<BackgroundWrite> batch;
+
+                    std::unique_lock<std::mutex> lock(shard.latch);
+                    uint depth = shard.cache->getSize() / 4 + 1;
+                    Node *node = shard.cache->getLeastRecent();
+                    for (uint scanned = 0; node != nullptr && scanned < depth && batch.size() < WRITEBACK_BATCH; scanned++)
+                    {
+                        if (node->dirty && !node->in_flight && !LRUCache::inUse(node))
+                        {
+                            uint tag = node->id >> 32;
+                            BackgroundWrite write;
+                            write.tag = tag;
+                            write.local = node->pos;
+                            owners[tag]->getWriteBack((uint)node->id, write.write);
+
+                            setDirty(node, false);
+                            node->in_flight = 1;
+                            shard.background_writes[tag]++;
+                            batch.push_back(write);
+                        }
+                        node = shard.cache->getMoreRecent(node);
+                    }
+                    if (batch.empty())
+                        continue;
+
+                    // the frames stay in flight, so no eviction can reuse them
+                    // while they are written through their owner's backend
+                    lock.unlock();
+                    for (size_t i = 0; i < batch.size(); i++)
+                        owners[batch[i].tag]->writeBack(batch[i].write, getFrame(framePos(shard, batch[i].local)));
+                    lock.lock();
+
+                    for (size_t i = 0; i < batch.size(); i++)
+                        shard.cache->getNode(batch[i].local)->in_flight = 0;
+                    shard.frame_cv.notify_all();
+                    written += batch.size();
+                }
+
+                // all dirty blocks are hot, check again later
+                if (written == 0)
+                {
+                    std::unique_lock<std::mutex> lock(writeback_latch);
+                    writeback_cv.wait_for(lock, std::chrono::milliseconds(100), [this] { return (bool)stop_writeback; });
+                }
+            }
+        }
+    }
+
+public:
+    // position returned for blocks that are not in the pool
+    static const uint NOT_RESIDENT = LRUCache::NOT_FOUND;
+
+    BufferPool(uint _capacity, bool _huge_pages = false, CachePolicy _policy = CACHE_LRU) : capacity(_capacity), pin_frac(0), huge_pages(_huge_pages), num_dirty(0),
+                                                            writeback_running(false), stop_writeback(false), high_watermark(UINT32_MAX), low_watermark(0),
+                                                            swizzle_slots(0)
+    {
+        shard_bits = shardBits(capacity);
+        num_shards = 1u << shard_bits;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            Shard *shard = new Shard();
+            shard->index = i;
+            shard->capacity = shardCapacity(capacity, i);
+            shard->pin_capacity = 0;
+            shard->cache = new LRUCache(shard->capacity, _policy);
+            shards.push_back(shard);
+        }
+
+        chunks = new std::atomic<Block *>[POOL_MAX_CHUNKS];
+        for (uint i = 0; i < POOL_MAX_CHUNKS; i++)
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~BufferPool()
+    {
+        stopWriteBack();
+
+        for (uint i = 0; i < POOL_MAX_CHUNKS; i++)
+        {
+            Block *chunk = chunks[i].load();
+            if (chunk != nullptr)
+                munmap(chunk, POOL_CHUNK_FRAMES * sizeof(Block));
+        }
+        delete[] chunks;
+
+        for (uint i = 0; i < num_shards; i++)
+        {
+            for (uint local = 0; local < shards[i]->cache->getPositions(); local++)
+                delete[] shards[i]->cache->getNode(local)->swizzled.load();
+            delete shards[i]->cache;
+            delete shards[i];
+        }
+    }
+
+    static cache_key pageKey(uint tag, uint id)
+    {
+        return ((cache_key)tag << 32) | id;
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: opens a pin scope for the calling thread. Until the matching
+     *  endPinScope(), frames passed to keepFrame() stay in use, so no other
+     *  thread can evict them while the caller works on them. Scopes nest;
+     *  the frames are released when the outermost one ends.
+     */
+    static void beginPinScope() { threadPinScope().depth++; }
+
+    static void endPinScope()
+    {
+        PinScope &scope = threadPinScope();
+        assert(scope.depth > 0);
+        if (--scope.depth > 0)
+            return;
+
+        for (size_t i = 0; i < scope.frames.size(); i++)
+            LRUCache::release(scope.frames[i].node);
+        scope.frames.clear();
+    }
+
+    // releases the frames kept by the pin scope of the calling thread so far,
+    // for scans that move on from the blocks they opened
+    static void releasePinScope()
+    {
+        PinScope &scope = threadPinScope();
+        for (size_t i = 0; i < scope.frames.size(); i++)
+            LRUCache::release(scope.frames[i].node);
+        scope.frames.clear();
+    }
+
+    static bool inPinScope() { return threadPinScope().depth > 0; }
+
+    /**
+     *  returns: the frame of block [id] of owner [tag] if the pin scope of the
+     *  calling thread opened it recently, NOT_RESIDENT otherwise
+     *  Function: lets a thread reopen a block it keeps in use without a
+     *  lookup. Only the last POOL_SCOPE_PROBE frames of the scope are
+     *  checked, which catches the repeated opens of the node being worked on.
+     *  [frame_node] receives the frame's descriptor.
+     */
+    uint findKeptFrame(uint tag, uint id, Node **frame_node = nullptr)
+    {
+        PinScope &scope = threadPinScope();
+        cache_key key = pageKey(tag, id);
+        size_t probes = std::min(scope.frames.size(), (size_t)POOL_SCOPE_PROBE);
+        for (size_t i = scope.frames.size(); i > scope.frames.size() - probes; i--)
+        {
+            if (scope.frames[i - 1].key == key && scope.frames[i - 1].pool == this)
+            {
+                if (frame_node)
+                    *frame_node = scope.frames[i - 1].node;
+                return scope.frames[i - 1].pos;
+            }
+        }
+        return NOT_RESIDENT;
+    }
+
+    // hands the frame [pos] (with descriptor [node]) of block [id] of owner
+    // [tag], as returned by lookup() or admit(), to the pin scope of the
+    // calling thread, or releases it right away if there is none
+    void keepFrame(uint tag, uint id, uint pos, Node *node)
+    {
+        PinScope &scope = threadPinScope();
+        if (scope.depth == 0)
+        {
+            LRUCache::release(node);
+            return;
+        }
+
+        ScopeFrame frame;
+        frame.pool = this;
+        frame.key = pageKey(tag, id);
+        frame.pos = pos;
+        frame.node = node;
+        scope.frames.push_back(frame);
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: turns on pointer swizzling for blocks with up to [slots]
+     *  children. Every frame then keeps, next to the block, direct references
+     *  to the frames of the block's children (see followChild), so walking
+     *  from a parent to a resident child skips the lookup in the shard and its
+     *  latch. Call before the pool is used.
+     */
+    void enableSwizzling(uint slots) { swizzle_slots = std::max(swizzle_slots, slots); }
+
+    bool isSwizzling() { return swizzle_slots > 0; }
+
+    /**
+     *  returns: the frame of block [id] of owner [tag], in use by the caller,
+     *  if the frame [parent] holds a valid reference to it in [slot], and
+     *  NOT_RESIDENT otherwise; [child] receives the frame's descriptor
+     *  Function: the reference was stored by swizzleChild(). It is checked
+     *  against the block the frame holds now, so references to children that
+     *  were evicted or moved to another slot since are not followed. The
+     *  caller is expected to keep [parent] in use.
+     */
+    uint followChild(Node *parent, uint slot, uint tag, uint id, Node **child)
+    {
+        std::atomic<Node *> *refs = parent->swizzled.load(std::memory_order_acquire);
+        if (refs == nullptr || slot >= swizzle_slots)
+            return NOT_RESIDENT;
+
+        Node *node = refs[slot].load(std::memory_order_acquire);
+        cache_key key = pageKey(tag, id);
+        if (node == nullptr || !LRUCache::tryAcquire(node, key))
+            return NOT_RESIDENT;
+
+        *child = node;
+        return framePos(shardOf(key), node->pos);
+    }
+
+    // stores a reference from the frame [parent] to the frame [child] of its
+    // child in [slot], for followChild()
+    void swizzleChild(Node *parent, uint slot, Node *child)
+    {
+        if (slot >= swizzle_slots)
+            return;
+
+        std::atomic<Node *> *refs = parent->swizzled.load(std::memory_order_acquire);
+        if (refs == nullptr)
+        {
+            std::atomic<Node *> *fresh = new std::atomic<Node *>[swizzle_slots];
+            for (uint i = 0; i < swizzle_slots; i++)
+                fresh[i].store(nullptr, std::memory_order_relaxed);
+            if (parent->swizzled.compare_exchange_strong(refs, fresh))
+                refs = fresh;
+            else
+                delete[] fresh;
+        }
+        refs[slot].store(child, std::memory_order_release);
+    }
+
+    // returns the tag the owner identifies its blocks with
+    uint registerOwner(BufferPoolOwner *owner)
+    {
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            shards[i]->owner_frames.push_back(0);
+            shards[i]->background_writes.push_back(0);
+        }
+        owners.push_back(owner);
+        return owners.size() - 1;
+    }
+
+    uint getCapacity() { return capacity; }
+
+    uint getNumShards() { return num_shards; }
+
+    uint getOwnerFrames(uint tag)
+    {
+        uint frames = 0;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            frames += shards[i]->owner_frames[tag];
+        }
+        return frames;
+    }
+
+    unsigned long long getBackgroundWrites(uint tag)
+    {
+        unsigned long long writes = 0;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            writes += shards[i]->background_writes[tag];
+        }
+        return writes;
+    }
+
+    uint getNumDirty() { return num_dirty; }
+
+    // switches the replacement policy, the blocks in the pool stay
+    void setPolicy(CachePolicy policy)
+    {
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            shards[i]->cache->setPolicy(policy);
+        }
+    }
+
+    const char *getPolicyName() { return shards[0]->cache->getPolicyName(); }
+
+    /**
+     *  returns: N/A
+     *  Function: starts the background writer, which keeps the share of dirty
+     *  frames between [low_frac] and [high_frac] of the capacity.
+     */
+    void startWriteBack(float high_frac, float low_frac)
+    {
+        if (writeback_running)
+            return;
+
+        high_watermark = std::max(1u, (uint)(capacity * high_frac));
+        low_watermark = std::min(high_watermark - 1, (uint)(capacity * low_frac));
+        stop_writeback = false;
+        writeback_running = true;
+        writeback_thread = std::thread(&BufferPool::writeBackLoop, this);
+    }
+
+    // stops the background writer after its current round
+    void stopWriteBack()
+    {
+        if (!writeback_running)
+            return;
+
+        {
+            std::lock_guard<std::mutex> guard(writeback_latch);
+            stop_writeback = true;
+        }
+        writeback_cv.notify_one();
+        writeback_thread.join();
+        writeback_running = false;
+    }
+
+    // number of frames backed by memory, in use or not
+    uint getAllocatedFrames()
+    {
+        uint num = 0;
+        for (uint i = 0; i < POOL_MAX_CHUNKS; i++)
+        {
+            if (chunks[i].load(std::memory_order_relaxed) != nullptr)
+                num += POOL_CHUNK_FRAMES;
+        }
+        return num;
+    }
+
+    Block *getFrame(uint pos) { return chunks[pos / POOL_CHUNK_FRAMES].load(std::memory_order_acquire) + (pos % POOL_CHUNK_FRAMES); }
+
+    /**
+     *  returns: N/A
+     *  Function: lets pinned blocks take up to [frac] of the capacity (at
+     *  least one frame is always left to the replacement policy). Pinned
+     *  blocks beyond a lowered quota are unpinned.
+     */
+    void setPinFraction(float frac)
+    {
+        pin_frac = frac;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            shards[i]->pin_capacity = pinQuota(shards[i]->capacity);
+            unpinExcess(*shards[i]);
+        }
+    }
+
+    uint getPinCapacity()
+    {
+        uint pins = 0;
+        for (uint i = 0; i < num_shards; i++)
+            pins += shards[i]->pin_capacity;
+        return pins;
+    }
+
+    uint getNumPinned()
+    {
+        uint pinned = 0;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            pinned += shards[i]->cache->getNumPinned();
+        }
+        return pinned;
+    }
+
+    /**
+     *  returns: false if the block is not resident or the pin quota is used up
+     *  Function: keeps block [id] of owner [tag] in the pool until unpin() is
+     *  called, whatever the replacement policy would pick.
+     */
+    bool pin(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.latch);
+        if (shard.cache->isPinned(key))
+            return true;
+        if (shard.cache->getNumPinned() >= shard.pin_capacity)
+            return false;
+        return shard.cache->pin(key);
+    }
+
+    void unpin(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.latch);
+        shard.cache->unpin(key);
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: changes the number of frames the pool may use. When shrinking,
+     *  least recently used blocks are evicted (and written back if dirty) until
+     *  the pool fits, and the memory of their frames is given back to the kernel.
+     *  The pin quota keeps its share of the capacity. No frame may be in use
+     *  while this runs.
+     */
+    void setCapacity(uint _capacity)
+    {
+        assert(_capacity / num_shards + 1 <= (POOL_MAX_CHUNKS * POOL_CHUNK_FRAMES) / num_shards);
+
+        // keep the watermarks at the same share of the pool
+        if (writeback_running)
+        {
+            float high_frac = (float)high_watermark / capacity;
+            float low_frac = (float)low_watermark / capacity;
+            high_watermark = std::max(1u, (uint)(_capacity * high_frac));
+            low_watermark = std::min(high_watermark - 1, (uint)(_capacity * low_frac));
+        }
+
+        capacity = _capacity;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            Shard &shard = *shards[i];
+            std::unique_lock<std::mutex> lock(shard.latch);
+            shard.capacity = shardCapacity(capacity, i);
+            shard.cache->setCapacity(shard.capacity);
+            shard.pin_capacity = pinQuota(shard.capacity);
+            unpinExcess(shard);
+            shrinkShard(lock, shard, true);
+        }
+    }
+
+    /**
+     *  returns: the frame of the block, in use by the caller, or NOT_RESIDENT
+     *  Function: finds block [id] of owner [tag] and marks it as most
+     *  recently used. The caller releases the frame with unpinFrame() or
+     *  keepFrame(); [frame_node] receives the frame's descriptor for the latter.
+     */
+    uint lookup(uint tag, uint id, Node **frame_node = nullptr)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::unique_lock<std::mutex> lock(shard.latch);
+        uint local = shard.cache->get(key);
+        if (local == LRUCache::NOT_FOUND)
+            return NOT_RESIDENT;
+
+        shard.cache->acquire(local);
+        waitForFrame(lock, shard, shard.cache->getNode(local));
+        if (frame_node)
+            *frame_node = shard.cache->getNode(local);
+        return framePos(shard, local);
+    }
+
+    // returns the frame of the block without touching the recency order
+    uint find(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::unique_lock<std::mutex> lock(shard.latch);
+        uint local = shard.cache->peek(key);
+        if (local == LRUCache::NOT_FOUND)
+            return NOT_RESIDENT;
+
+        waitForFrame(lock, shard, shard.cache->getNode(local));
+        return framePos(shard, local);
+    }
+
+    bool contains(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.latch);
+        return shard.cache->contains(key);
+    }
+
+    /**
+     *  returns: frame position of the block, in use by the caller
+     *  Function: gives block [id] of owner [tag] a frame, evicting the block
+     *  the replacement policy picks if the shard is full. If another thread
+     *  admitted the block first, its frame is returned and needs_load is
+     *  false. Otherwise the caller fills the frame and calls finishLoad();
+     *  if the evicted block must be written back, needs_write_back is set,
+     *  write_back describes the write and the caller has to write the frame
+     *  out before filling it. Until finishLoad(), threads asking for either
+     *  block wait.
+     */
+    uint admit(uint tag, uint id, IORequest &write_back, bool &needs_write_back, bool &needs_load, Node **frame_node = nullptr)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::unique_lock<std::mutex> lock(shard.latch);
+        waitForWriteBack(lock, shard, key);
+
+        needs_write_back = false;
+        needs_load = false;
+
+        uint local = shard.cache->peek(key);
+        if (local != LRUCache::NOT_FOUND)
+        {
+            shard.cache->get(key);
+            shard.cache->acquire(local);
+            waitForFrame(lock, shard, shard.cache->getNode(local));
+            if (frame_node)
+                *frame_node = shard.cache->getNode(local);
+            return framePos(shard, local);
+        }
+
+        cache_key evicted_key = 0;
+        local = shard.cache->put(key, &evicted_key);
+        Node *node = shard.cache->getNode(local);
+        uint pos = framePos(shard, local);
+
+        if (evicted_key > 0)
+        {
+            uint evicted_tag = evicted_key >> 32;
+            shard.owner_frames[evicted_tag]--;
+            unswizzle(node);
+            needs_write_back = owners[evicted_tag]->evictBlock((uint)evicted_key, node->dirty, write_back);
+            setDirty(node, false);
+            if (needs_write_back)
+                shard.writing.push_back(std::make_pair(evicted_key, local));
+        }
+
+        // the new block is in flight since put(); the policy never picks
+        // frames in flight, so the victim was not being written either
+        shard.cache->acquire(local);
+        needs_load = true;
+        if (frame_node)
+            *frame_node = node;
+        shard.owner_frames[tag]++;
+
+        // the shard grew past its share while all of its frames were in use
+        if (shard.cache->getSize() > shard.capacity)
+            shrinkShard(lock, shard, false);
+
+        lock.unlock();
+        ensureChunk(pos);
+        return pos;
+    }
+
+    // the caller of admit() is done filling the frame at [pos]
+    void finishLoad(uint pos)
+    {
+        Shard &shard = shardOfFrame(pos);
+        uint local = pos / num_shards;
+        std::lock_guard<std::mutex> guard(shard.latch);
+        shard.cache->getNode(local)->in_flight = 0;
+        for (size_t i = 0; i < shard.writing.size(); i++)
+        {
+            if (shard.writing[i].second == local)
+            {
+                shard.writing[i] = shard.writing.back();
+                shard.writing.pop_back();
+                break;
+            }
+        }
+        shard.frame_cv.notify_all();
+    }
+
+    // ends a use of the frame at [pos] begun by lookup(), admit() or takeDirtyBlock()
+    void unpinFrame(uint pos)
+    {
+        Shard &shard = shardOfFrame(pos);
+        std::lock_guard<std::mutex> guard(shard.latch);
+        LRUCache::release(shard.cache->getNode(pos / num_shards));
+    }
+
+    // drops the block from the pool without writing it back
+    void release(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::unique_lock<std::mutex> lock(shard.latch);
+        uint local = shard.cache->peek(key);
+        if (local == LRUCache::NOT_FOUND)
+            return;
+
+        Node *node = shard.cache->getNode(local);
+        waitForFrame(lock, shard, node);
+
+        // a block in use could not be dropped from the pin scope holding it
+        assert(!LRUCache::inUse(node));
+        setDirty(node, false);
+        unswizzle(node);
+        shard.cache->remove(key);
+        shard.owner_frames[tag]--;
+    }
+
+    void markDirty(uint pos)
+    {
+        Shard &shard = shardOfFrame(pos);
+        std::lock_guard<std::mutex> guard(shard.latch);
+        setDirty(shard.cache->getNode(pos / num_shards), true);
+    }
+
+    bool isDirty(uint pos) { return frameNode(pos)->dirty; }
+
+    // makes the block one of the next to be evicted
+    void demote(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::lock_guard<std::mutex> guard(shard.latch);
+        shard.cache->demote(key);
+    }
+
+    // returns the frame of the block, in use by the caller, and marks it clean
+    // if it is resident and dirty, NOT_RESIDENT otherwise; the caller has to
+    // write the block and then release the frame with unpinFrame()
+    uint takeDirtyBlock(uint tag, uint id)
+    {
+        cache_key key = pageKey(tag, id);
+        Shard &shard = shardOf(key);
+        std::unique_lock<std::mutex> lock(shard.latch);
+        uint local = shard.cache->peek(key);
+        if (local == LRUCache::NOT_FOUND || !shard.cache->getNode(local)->dirty)
+            return NOT_RESIDENT;
+
+        Node *node = shard.cache->getNode(local);
+        waitForFrame(lock, shard, node);
+        setDirty(node, false);
+        shard.cache->acquire(local);
+        return framePos(shard, local);
+    }
+
+    /**
+     *  returns: (block id, frame position) of every dirty block of the owner, unordered
+     *  Function: collects the dirty blocks of owner [tag] for a flush and marks
+     *  them clean; the caller has to write all of them and release every
+     *  frame with unpinFrame().
+     */
+    std::vector<std::pair<uint, uint>> takeDirtyBlocks(uint tag)
+    {
+        std::vector<std::pair<uint, uint>> blocks;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            Shard &shard = *shards[i];
+            std::unique_lock<std::mutex> lock(shard.latch);
+            for (uint local = 0; local < shard.cache->getPositions(); local++)
+            {
+                Node *node = shard.cache->getNode(local);
+                if (node->id != 0 && (uint)(node->id >> 32) == tag && node->dirty)
+                {
+                    waitForFrame(lock, shard, node);
+                    setDirty(node, false);
+                    shard.cache->acquire(local);
+                    blocks.push_back(std::make_pair((uint)node->id, framePos(shard, local)));
+                }
+            }
+        }
+        return blocks;
+    }
+
+    // ids of all blocks of the owner that are in the pool
+    std::vector<uint> getResidentBlocks(uint tag)
+    {
+        std::vector<uint> ids;
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            for (uint local = 0; local < shards[i]->cache->getPositions(); local++)
+            {
+                Node *node = shards[i]->cache->getNode(local);
+                if (node->id != 0 && (uint)(node->id >> 32) == tag)
+                    ids.push_back((uint)node->id);
+            }
+        }
+        return ids;
+    }
+
+    /**
+     *  returns: ids of the blocks of the owner that are in the pool, hottest
+     *  first
+     *  Function: the pinned blocks come first ([num_pinned] of them), then the
+     *  others from the most to the least recently used. Every shard has its
+     *  own recency order, so the shards' lists are interleaved rank by rank.
+     */
+    std::vector<uint> getResidentBlocksByRecency(uint tag, uint &num_pinned)
+    {
+        std::vector<uint> ids;
+        std::vector<std::vector<uint>> ranked(num_shards);
+        for (uint i = 0; i < num_shards; i++)
+        {
+            std::lock_guard<std::mutex> guard(shards[i]->latch);
+            LRUCache *cache = shards[i]->cache;
+            for (uint local = 0; local < cache->getPositions(); local++)
+            {
+                Node *node = cache->getNode(local);
+                if (node->id != 0 && (uint)(node->id >> 32) == tag && node->pinned)
+                    ids.push_back((uint)node->id);
+            }
+
+            for (Node *node = cache->getLeastRecent(); node != nullptr; node = cache->getMoreRecent(node))
+            {
+                if ((uint)(node->id >> 32) == tag)
+                    ranked[i].push_back((uint)node->id);
+            }
+        }
+        num_pinned = ids.size();
+
+        for (size_t rank = 1;; rank++)
+        {
+            bool any = false;
+            for (uint i = 0; i < num_shards; i++)
+            {
+                if (rank > ranked[i].size())
+                    continue;
+                ids.push_back(ranked[i][ranked[i].size() - rank]);
+                any = true;
+            }
+            if (!any)
+                break;
+        }
+        return ids;
+    }
+};
+
+// keeps the frames the calling thread opens in use until it goes out of scope
+class FramePinScope
+{
+public:
+    FramePinScope() { BufferPool::beginPinScope(); }
+    ~FramePinScope() { BufferPool::endPinScope(); }
+};
+
+#endif
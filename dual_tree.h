@@ -2,6 +2,11 @@
 #define DUEALTREE_H
 #include "betree.h"
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <iomanip>
+#include <limits>
+#include <sstream>
 
 template<typename _key, typename _value>
 class DUAL_TREE_KNOBS
@@ -118,6 +123,19 @@ public:
 
     double get_tolerance_factor() { return tolerance_factor; }
 
+    // Write and read back the state the detector has learned from the inserted keys,
+    //so that a reopened dual tree goes on where it left off.
+    void save(std::ostream& out)
+    {
+        out << std::setprecision(std::numeric_limits<float>::max_digits10) << avg_distance << " " 
+            << tolerance_factor << " " << previous_key;
+    }
+
+    void load(std::istream& in)
+    {
+        in >> avg_distance >> tolerance_factor >> previous_key;
+    }
+
     /**
      *  Check whether a key is an outlier with repsect to the sorted tree.
      * @param new_key The pending new key
@@ -278,6 +296,18 @@ class dual_tree
 
     MRU_query_buffer<_key> *query_buf;
 
+    // Frames shared by the two trees under one memory budget.
+    BufferPool *pool;
+
+    // Directory holding the manifest, and the directories of the two tree files.
+    std::string root_dir;
+    std::string sorted_dir;
+    std::string unsorted_dir;
+
+    // Number of blocks of each tree as of the last manifest update.
+    uint sorted_blocks;
+    uint unsorted_blocks;
+
     template <class T, class S, class C>
     S& container(std::priority_queue<T, S, C>& q)
     {
@@ -294,13 +324,36 @@ class dual_tree
 
 public:
 
-    // Default constructor, disable the buffer.
-    dual_tree()
-    {   
-        unsorted_tree = new BeTree<_key, _value, _betree_knobs, _compare>("manager", "./tree_dat", 
-    _betree_knobs::BLOCK_SIZE, _betree_knobs::BLOCKS_IN_MEMORY, DUAL_TREE_KNOBS<_key, _value>::UNSORTED_TREE_SPLIT_FRAC);
-        sorted_tree = new BeTree<_key, _value, _betree_knobs, _compare>("manager", "./tree_dat", 
-    _betree_knobs::BLOCK_SIZE, _betree_knobs::BLOCKS_IN_MEMORY, DUAL_TREE_KNOBS<_key, _value>::SORTED_TREE_SPLIT_FRAC);
+    /**
+     * Creates an empty dual tree. Each tree gets its own file and block id space:
+     * the sorted tree lives in <sorted_dir>/sorted_tree and the unsorted tree in
+     * <unsorted_dir>/unsorted_tree, both directories defaulting to @root_dir. The
+     * two directories may be on different devices. @root_dir also holds the
+     * MANIFEST file that records where the trees are stored. With @reopen, the
+     * dual tree last flushed to the same directories is opened again instead.
+     */
+    dual_tree(std::string root_dir = "./tree_dat", std::string sorted_dir = "", std::string unsorted_dir = "",
+        bool reopen = false)
+        : root_dir(root_dir), sorted_dir(sorted_dir.empty() ? root_dir : sorted_dir),
+          unsorted_dir(unsorted_dir.empty() ? root_dir : unsorted_dir)
+    {
+        make_directory(this->root_dir);
+        make_directory(this->sorted_dir);
+        make_directory(this->unsorted_dir);
+
+        // both trees draw their frames from one pool of BLOCKS_IN_MEMORY blocks,
+        //so frames move to whichever tree is currently being accessed
+        pool = new BufferPool(_betree_knobs::BLOCKS_IN_MEMORY, _betree_knobs::HUGE_PAGES, _betree_knobs::CACHE_POLICY);
+        pool->setPinFraction(_betree_knobs::INTERNAL_POOL_FRACTION);
+        if (_betree_knobs::POINTER_SWIZZLING)
+            pool->enableSwizzling(_betree_knobs::NUM_CHILDREN);
+        if (_betree_knobs::BACKGROUND_WRITEBACK)
+            pool->startWriteBack(_betree_knobs::WRITEBACK_HIGH_WATERMARK, _betree_knobs::WRITEBACK_LOW_WATERMARK);
+
+        unsorted_tree = new BeTree<_key, _value, _betree_knobs, _compare>("unsorted_tree", this->unsorted_dir, 
+    _betree_knobs::TREE_BLOCK_SIZE, _betree_knobs::BLOCKS_IN_MEMORY, DUAL_TREE_KNOBS<_key, _value>::UNSORTED_TREE_SPLIT_FRAC, pool, reopen);
+        sorted_tree = new BeTree<_key, _value, _betree_knobs, _compare>("sorted_tree", this->sorted_dir, 
+    _betree_knobs::TREE_BLOCK_SIZE, _betree_knobs::BLOCKS_IN_MEMORY, DUAL_TREE_KNOBS<_key, _value>::SORTED_TREE_SPLIT_FRAC, pool, reopen);
         sorted_size = 0;
         unsorted_size = 0;
 
@@ -310,19 +363,82 @@ public:
         od = new outlier_detector<_key>(_dual_tree_knobs::INIT_TOLERANCE_FACTOR, _dual_tree_knobs::MIN_TOLERANCE_FACTOR, 
              _dual_tree_knobs::EXPECTED_AVG_DISTANCE);
         query_buf = new MRU_query_buffer<_key>(_dual_tree_knobs::QUERY_BUFFER_SIZE);
+
+        if(reopen)
+            read_manifest();
+        write_manifest();
     }
 
     // Deconstructor
     ~dual_tree()
     {
+        write_manifest();
         delete sorted_tree;
         delete unsorted_tree;
+        delete pool;
         if(_dual_tree_knobs::HEAP_SIZE > 0)
             delete heap_buf;
         delete od;
         delete query_buf;
     }
 
+    // Write all modified blocks of the sorted tree back to its file.
+    void flush_sorted_tree()
+    {
+        sorted_tree->flush();
+        write_manifest();
+    }
+
+    // Write all modified blocks of the unsorted tree back to its file.
+    void flush_unsorted_tree()
+    {
+        unsorted_tree->flush();
+        write_manifest();
+    }
+
+    void flush()
+    {
+        sorted_tree->flush();
+        unsorted_tree->flush();
+        write_manifest();
+    }
+
+    // Load the blocks both trees had cached at their last flush back into the
+    // buffer pool (see WARM_UP_SNAPSHOT), returns the number of blocks read.
+    uint warm_up_cache()
+    {
+        return sorted_tree->warmUpCache() + unsorted_tree->warmUpCache();
+    }
+
+    // Give the space of freed blocks of both trees back to the file system,
+    // returns the number of blocks the tree files shrank by.
+    uint compact()
+    {
+        uint shrunk = sorted_tree->compact() + unsorted_tree->compact();
+        write_manifest();
+        return shrunk;
+    }
+
+    // changes the number of blocks both trees may keep in memory together
+    void set_buffer_pool_capacity(uint blocks) { pool->setCapacity(blocks); }
+
+    uint buffer_pool_capacity() { return pool->getCapacity(); }
+
+    // switches the replacement policy of the buffer pool of both trees
+    void set_cache_policy(CachePolicy policy) { pool->setPolicy(policy); }
+
+    // starts (or, with 0, stops) estimating the miss ratio curves of both
+    // trees, sampling about [rate] of their blocks; restarting drops the
+    // samples taken so far
+    void set_miss_ratio_sampling(double rate)
+    {
+        sorted_tree->setMissRatioSampling(rate);
+        unsorted_tree->setMissRatioSampling(rate);
+    }
+
+    // resizes the share of the buffer pool reserved for pinned internal nodes
+    void set_internal_pool_fraction(float frac) { pool->setPinFraction(frac); }
+
     uint sorted_tree_size() { return sorted_size;}
 
     uint unsorted_tree_size() { return unsorted_size;}
@@ -425,7 +541,8 @@ public:
         }
     }
 
-    // query both trees in parallel
+    // query both trees in parallel. The trees share the buffer pool, which
+    // is safe to use from several threads; see BufferPool and BeTree::tree_latch.
     bool parallelQuery(_key key) {
 
         // fire up a thread to query the sorted tree
@@ -442,7 +559,20 @@ public:
         sortedQuery.join();
         unsortedQuery.join();
 
-        return sortedFuture.get() || unsortedFuture.get();
+        if (sortedFuture.get() || unsortedFuture.get())
+            return true;
+
+        // Search the buffer
+        std::vector<std::pair<_key, _value>> &tmp = container(*(this->heap_buf));
+        for(typename std::vector<std::pair<_key, _value>>::iterator it = tmp.begin(); it !=tmp.end(); it++)
+        {
+            if((*it).first == key) 
+            {
+                return true;
+            }
+        }
+
+        return false;
     }
 
     bool MRU_query(_key key)
@@ -527,6 +657,12 @@ public:
         std::cout << "Sorted Tree: Minimum value = " << sorted_tree->getMinimumKey() << std::endl;
         std::cout << "Sorted Tree: Average Distance between tuples = " << this->od->get_avg_distance() << std::endl;
         std::cout << "Sorted Tree: Tolerance factor = " << this->od->get_tolerance_factor() << std::endl;
+        std::cout << "Sorted Tree: Buffer pool frames = " << sorted_tree->getResidentBlocks() << std::endl;
+        std::cout << "Sorted Tree: Write-backs (foreground / background) = " << sorted_tree->getForegroundWrites()
+            << " / " << sorted_tree->getBackgroundWrites() << std::endl;
+        std::cout << "Sorted Tree: Sealed leaves written = " << sorted_tree->getSealedWrites() << std::endl;
+        if (_betree_knobs::LEARNED_INDEX)
+            std::cout << "Sorted Tree: Learned index segments = " << sorted_tree->getLearnedSegments() << std::endl;
 
         unsorted_tree->fanout();
         std::cout << "Unsorted Tree: number of splitting leaves = " << unsorted_tree->traits.leaf_splits
@@ -539,10 +675,56 @@ public:
             unsorted_tree->traits.num_internal_nodes << std::endl;
         std::cout << "Unsorted Tree: Maximum value = " << unsorted_tree->getMaximumKey() << std::endl;
         std::cout << "Unsorted Tree: Minimum value = " << unsorted_tree->getMinimumKey() << std::endl;
+        std::cout << "Unsorted Tree: Buffer pool frames = " << unsorted_tree->getResidentBlocks() << std::endl;
+        std::cout << "Unsorted Tree: Write-backs (foreground / background) = " << unsorted_tree->getForegroundWrites()
+            << " / " << unsorted_tree->getBackgroundWrites() << std::endl;
         
         std::cout << "Heap buf size = " << this->heap_buf->size() << std::endl;
     }
 
+    // Print the buffer pool hits and misses of both trees, split into leaves
+    // and internal nodes.
+    void print_cache_stats()
+    {
+        std::cout << "Cache policy = " << pool->getPolicyName() << std::endl;
+        std::cout << "Pinned internal nodes = " << pool->getNumPinned() << " / " << pool->getPinCapacity() << std::endl;
+        print_tree_cache_stats("Sorted Tree", sorted_tree);
+        print_tree_cache_stats("Unsorted Tree", unsorted_tree);
+    }
+
+    static void print_tree_cache_stats(const std::string &label, BeTree<_key, _value, _betree_knobs, _compare> *tree)
+    {
+        unsigned long long hits = tree->getLeafCacheHits() + tree->getInternalCacheHits();
+        unsigned long long misses = tree->getLeafCacheMisses() + tree->getInternalCacheMisses();
+        std::cout << label << ": Leaf cache hits / misses = " << tree->getLeafCacheHits() << " / "
+            << tree->getLeafCacheMisses() << std::endl;
+        std::cout << label << ": Internal cache hits / misses = " << tree->getInternalCacheHits() << " / "
+            << tree->getInternalCacheMisses() << std::endl;
+        std::cout << label << ": Hit rate = " << (hits + misses > 0 ? (double)hits / (hits + misses) : 0.0) << std::endl;
+    }
+
+    // prints the estimated hit ratios of both trees for every cache size in
+    // [cache_blocks], by block class, and the cache each tree needs for
+    // [target] hit ratio (see set_miss_ratio_sampling)
+    void print_miss_ratio_curve(const std::vector<uint> &cache_blocks, double target = 0.9)
+    {
+        print_tree_miss_ratio_curve("Sorted Tree", sorted_tree, cache_blocks, target);
+        print_tree_miss_ratio_curve("Unsorted Tree", unsorted_tree, cache_blocks, target);
+    }
+
+    static void print_tree_miss_ratio_curve(const std::string &label, BeTree<_key, _value, _betree_knobs, _compare> *tree,
+                                            const std::vector<uint> &cache_blocks, double target)
+    {
+        for (size_t i = 0; i < cache_blocks.size(); i++)
+        {
+            std::cout << label << ": Predicted hit rate with " << cache_blocks[i] << " blocks (leaf / internal / all) = "
+                << tree->getPredictedHitRatio(cache_blocks[i], BLOCK_LEAF) << " / "
+                << tree->getPredictedHitRatio(cache_blocks[i], BLOCK_INTERNAL) << " / "
+                << tree->getPredictedHitRatio(cache_blocks[i], BLOCK_ANY) << std::endl;
+        }
+        std::cout << label << ": Blocks for a hit rate of " << target << " = " << tree->getBlocksForHitRatio(target) << std::endl;
+    }
+
     static void show_tree_knobs()
     {
         std::cout << "B Epsilon Tree Knobs:" << std::endl;
@@ -553,9 +735,9 @@ public:
 #ifdef UNITTEST
 
 #else
-        std::cout << "Block Size = " << _betree_knobs::BLOCK_SIZE << std::endl;
+        std::cout << "Block Size = " << _betree_knobs::TREE_BLOCK_SIZE << std::endl;
         std::cout << "Data Size = " << _betree_knobs::DATA_SIZE << std::endl;
-        std::cout << "Block Size = " << _betree_knobs::BLOCK_SIZE << std::endl;
+        std::cout << "Block Size = " << _betree_knobs::TREE_BLOCK_SIZE << std::endl;
         std::cout << "Metadata Size = " << _betree_knobs::METADATA_SIZE << std::endl;
         std::cout << "Unit Size = " << _betree_knobs::UNIT_SIZE << std::endl;
         std::cout << "Pivots Size = " << _betree_knobs::PIVOT_SIZE << std::endl;
@@ -582,6 +764,83 @@ public:
     
 private:
 
+    static void make_directory(const std::string& dir)
+    {
+        if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            std::cout << "Error in creating directory " << dir << std::endl;
+        }
+    }
+
+    std::string manifest_file_name() { return root_dir + "/MANIFEST"; }
+
+    // Record the storage layout of the dual tree: one line per tree with its name, 
+    //file and number of blocks. The state of the dual tree itself follows (sizes of the
+    //trees, outlier detector and the tuples in the heap buffer), so that it can be reopened.
+    //The manifest is rewritten whenever a tree is flushed.
+    void write_manifest()
+    {
+        sorted_blocks = sorted_tree->getNumBlocks();
+        unsorted_blocks = unsorted_tree->getNumBlocks();
+
+        std::string tmp_name = manifest_file_name() + ".tmp";
+        std::ofstream manifest(tmp_name.c_str(), std::ios::out | std::ios::trunc);
+        manifest << "block_size " << _betree_knobs::TREE_BLOCK_SIZE << std::endl;
+        manifest << "tree sorted_tree " << sorted_dir << "/sorted_tree " << sorted_blocks << " "
+            << sorted_tree->getNumFreeBlocks() << std::endl;
+        manifest << "tree unsorted_tree " << unsorted_dir << "/unsorted_tree " << unsorted_blocks << " "
+            << unsorted_tree->getNumFreeBlocks() << std::endl;
+        manifest << "sizes " << sorted_size << " " << unsorted_size << std::endl;
+        manifest << "detector ";
+        od->save(manifest);
+        manifest << std::endl;
+        if(_dual_tree_knobs::HEAP_SIZE > 0)
+        {
+            std::vector<std::pair<_key, _value>>& heap = container(*heap_buf);
+            manifest << "heap " << heap.size();
+            for(size_t i = 0; i < heap.size(); i++)
+                manifest << " " << heap[i].first << " " << heap[i].second;
+            manifest << std::endl;
+        }
+        manifest.close();
+
+        // replace the old manifest atomically
+        rename(tmp_name.c_str(), manifest_file_name().c_str());
+    }
+
+    // Restore the state of the dual tree saved by write_manifest. The trees reopen
+    //their own files, the layout lines are only for readers of the manifest.
+    void read_manifest()
+    {
+        std::ifstream manifest(manifest_file_name().c_str());
+        std::string line;
+        while(std::getline(manifest, line))
+        {
+            std::istringstream fields(line);
+            std::string kind;
+            fields >> kind;
+            if(kind == "sizes")
+            {
+                fields >> sorted_size >> unsorted_size;
+            }
+            else if(kind == "detector")
+            {
+                od->load(fields);
+            }
+            else if(kind == "heap" && _dual_tree_knobs::HEAP_SIZE > 0)
+            {
+                size_t n = 0;
+                fields >> n;
+                for(size_t i = 0; i < n; i++)
+                {
+                    std::pair<_key, _value> tuple;
+                    fields >> tuple.first >> tuple.second;
+                    heap_buf->push(tuple);
+                }
+            }
+        }
+    }
+
     _key _get_insertion_range_lower_bound(bool& no_lower_bound) {
         if(!_dual_tree_knobs::ALLOW_SORTED_TREE_INSERTION){
             no_lower_bound = false;
@@ -0,0 +1,478 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define IO_URING_AVAILABLE
+#endif
+#endif
+
+enum IOOp
+{
+    IO_READ,
+    IO_WRITE,
+};
+
+// A single block request that can be handed to the asynchronous interface
+// of an IOBackend. result holds the number of bytes transferred (or -errno)
+// once the request has completed.
+struct IORequest
+{
+    IOOp op;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    ssize_t result;
+
+    // scratch space for backends that submit vectored operations
+    struct iovec iov;
+
+    IORequest() : op(IO_READ), fd(-1), buf(nullptr), len(0), offset(0), result(0) {}
+
+    IORequest(IOOp _op, int _fd, void *_buf, size_t _len, off_t _offset) : op(_op), fd(_fd), buf(_buf), len(_len),
+                                                                          offset(_offset), result(0) {}
+};
+
+enum IOBackendType
+{
+    // synchronous pread/pwrite
+    IO_BACKEND_POSIX,
+    // io_uring if the kernel supports it, a thread pool emulation otherwise
+    IO_BACKEND_ASYNC,
+};
+
+// Interface every block I/O layer of the BlockManager goes through. File
+// descriptors are owned by the caller; the backend only moves bytes.
+class IOBackend
+{
+public:
+    virtual ~IOBackend() {}
+
+    virtual const char *getName() = 0;
+
+    // true if submitted requests make progress concurrently, i.e. it is worth
+    // batching independent requests into one submission
+    virtual bool isAsync() { return false; }
+
+    // synchronous positional I/O
+    virtual ssize_t read(int fd, void *buf, size_t len, off_t offset) = 0;
+    virtual ssize_t write(int fd, const void *buf, size_t len, off_t offset) = 0;
+
+    // synchronous vectored I/O over a contiguous file range
+    virtual ssize_t readv(int fd, const struct iovec *iov, int iovcnt, off_t offset) = 0;
+    virtual ssize_t writev(int fd, const struct iovec *iov, int iovcnt, off_t offset) = 0;
+
+    // asynchronous interface: submit() queues and starts [num] requests,
+    // wait() blocks until every request submitted so far has completed.
+    // The request array must stay alive until wait() returns.
+    virtual void submit(IORequest *reqs, int num) = 0;
+    virtual void wait() = 0;
+};
+
+// Plain pread/pwrite backend. The asynchronous interface completes every
+// request inside submit(), so wait() has nothing left to do.
+class PosixIOBackend : public IOBackend
+{
+public:
+    const char *getName() { return "posix"; }
+
+    ssize_t read(int fd, void *buf, size_t len, off_t offset)
+    {
+        return pread(fd, buf, len, offset);
+    }
+
+    ssize_t write(int fd, const void *buf, size_t len, off_t offset)
+    {
+        return pwrite(fd, buf, len, offset);
+    }
+
+    ssize_t readv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        return preadv(fd, iov, iovcnt, offset);
+    }
+
+    ssize_t writev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+    {
+        return pwritev(fd, iov, iovcnt, offset);
+    }
+
+    void submit(IORequest *reqs, int num)
+    {
+        for (int i = 0; i < num; i++)
+        {
+            if (reqs[i].op == IO_READ)
+                reqs[i].result = read(reqs[i].fd, reqs[i].buf, reqs[i].len, reqs[i].offset);
+            else
+                reqs[i].result = write(reqs[i].fd, reqs[i].buf, reqs[i].len, reqs[i].offset);
+        }
+    }
+
+    void wait() {}
+};
+
+// Emulates asynchronous I/O with a small pool of threads issuing blocking
+// pread/pwrite calls. Used when io_uring is not available.
+class ThreadPoolIOBackend : public PosixIOBackend
+{
+    std::vector<std::thread> workers;
+    std::deque<IORequest *> pending;
+
+    // requests submitted but not completed yet
+    int outstanding;
+    bool stop;
+
+    std::mutex lock;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+
+    void work()
+    {
+        while (true)
+        {
+            IORequest *req;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                work_cv.wait(guard, [this]
+                             { return stop || !pending.empty(); });
+                if (pending.empty())
+                    return;
+                req = pending.front();
+                pending.pop_front();
+            }
+
+            if (req->op == IO_READ)
+                req->result = pread(req->fd, req->buf, req->len, req->offset);
+            else
+                req->result = pwrite(req->fd, req->buf, req->len, req->offset);
+
+            std::unique_lock<std::mutex> guard(lock);
+            if (--outstanding == 0)
+                done_cv.notify_all();
+        }
+    }
+
+public:
+    ThreadPoolIOBackend(int num_threads = 4) : outstanding(0), stop(false)
+    {
+        for (int i = 0; i < num_threads; i++)
+            workers.push_back(std::thread(&ThreadPoolIOBackend::work, this));
+    }
+
+    ~ThreadPoolIOBackend()
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            stop = true;
+        }
+        work_cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    const char *getName() { return "threadpool"; }
+
+    bool isAsync() { return true; }
+
+    void submit(IORequest *reqs, int num)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            for (int i = 0; i < num; i++)
+                pending.push_back(&reqs[i]);
+            outstanding += num;
+        }
+        work_cv.notify_all();
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done_cv.wait(guard, [this]
+                     { return outstanding == 0; });
+    }
+};
+
+#ifdef IO_URING_AVAILABLE
+// io_uring backend talking to the kernel through the raw syscalls, so that
+// no liburing is needed. Every request is a single IORING_OP_READV/WRITEV
+// entry; a whole batch is handed to the kernel with one io_uring_enter().
+// If the kernel stops accepting submissions, the backend hands every later
+// request to a thread pool instead.
+class IOUringBackend : public PosixIOBackend
+{
+    int ring_fd;
+    unsigned entries;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // entries placed in the submission ring but not passed to the kernel yet
+    unsigned to_submit;
+
+    // requests passed to the kernel whose completion was not reaped yet
+    unsigned inflight;
+
+    // takes over once io_uring_enter() failed, nullptr until then
+    ThreadPoolIOBackend *fallback;
+
+    // returns the result of io_uring_enter(), -errno on failure
+    int enter(unsigned submit, unsigned min_complete, unsigned flags)
+    {
+        int ret;
+        do
+        {
+            ret = syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+        return ret < 0 ? -errno : ret;
+    }
+
+    void reap()
+    {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            ((IORequest *)(uintptr_t)cqe->user_data)->result = cqe->res;
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /**
+     *  returns: N/A
+     *  Function: stops using the ring. Entries the kernel has not taken yet
+     *  are completed synchronously and taken back out of the ring, requests
+     *  it has taken still complete through it (see wait).
+     */
+    void giveUpRing()
+    {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        unsigned tail = *sq_tail;
+        for (unsigned i = head; i != tail; i++)
+        {
+            struct io_uring_sqe *sqe = &sqes[sq_array[i & *sq_mask]];
+            IORequest *req = (IORequest *)(uintptr_t)sqe->user_data;
+            PosixIOBackend::submit(req, 1);
+        }
+        __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+        to_submit = 0;
+
+        fallback = new ThreadPoolIOBackend();
+    }
+
+    // returns: false if the ring had to be given up
+    bool flushSubmissions()
+    {
+        while (to_submit > 0)
+        {
+            int ret = enter(to_submit, 0, 0);
+            if (ret > 0)
+            {
+                to_submit -= ret;
+                inflight += ret;
+                continue;
+            }
+
+            // out of resources for now: wait for a request to complete
+            if ((ret == -EAGAIN || ret == -EBUSY) && inflight > 0)
+            {
+                if (waitForCompletion())
+                    continue;
+                return false;
+            }
+
+            giveUpRing();
+            return false;
+        }
+        return true;
+    }
+
+    // returns: false if the ring had to be given up
+    bool waitForCompletion()
+    {
+        if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+        {
+            giveUpRing();
+            return false;
+        }
+        reap();
+        return true;
+    }
+
+public:
+    IOUringBackend(unsigned _entries = 256) : ring_fd(-1), entries(0), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes((struct io_uring_sqe *)MAP_FAILED),
+                                              to_submit(0), inflight(0), fallback(nullptr)
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ring_fd = syscall(__NR_io_uring_setup, _entries, &params);
+        if (ring_fd < 0)
+            return;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_ring_size = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+            cq_ring_size = sq_ring_size;
+        }
+
+        sq_ptr = mmap(0, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return;
+
+        cq_ptr = single_mmap ? sq_ptr : mmap(0, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return;
+
+        sqes = (struct io_uring_sqe *)mmap(0, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return;
+
+        sq_head = (unsigned *)((char *)sq_ptr + params.sq_off.head);
+        sq_tail = (unsigned *)((char *)sq_ptr + params.sq_off.tail);
+        sq_mask = (unsigned *)((char *)sq_ptr + params.sq_off.ring_mask);
+        sq_array = (unsigned *)((char *)sq_ptr + params.sq_off.array);
+
+        cq_head = (unsigned *)((char *)cq_ptr + params.cq_off.head);
+        cq_tail = (unsigned *)((char *)cq_ptr + params.cq_off.tail);
+        cq_mask = (unsigned *)((char *)cq_ptr + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)((char *)cq_ptr + params.cq_off.cqes);
+
+        entries = params.sq_entries;
+    }
+
+    ~IOUringBackend()
+    {
+        if (isReady())
+            wait();
+        if (sqes != MAP_FAILED)
+            munmap(sqes, entries * sizeof(struct io_uring_sqe));
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_ring_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_ring_size);
+        if (ring_fd >= 0)
+            close(ring_fd);
+        delete fallback;
+    }
+
+    // false if the kernel refused to set up a ring
+    bool isReady() { return entries > 0; }
+
+    const char *getName() { return "io_uring"; }
+
+    bool isAsync() { return true; }
+
+    void submit(IORequest *reqs, int num)
+    {
+        for (int i = 0; i < num; i++)
+        {
+            // make room in the ring; never have more requests outstanding
+            // than the completion ring is guaranteed to hold
+            while (!fallback && to_submit + inflight >= entries)
+            {
+                if (flushSubmissions())
+                    waitForCompletion();
+            }
+
+            if (fallback)
+            {
+                fallback->submit(reqs + i, num - i);
+                return;
+            }
+
+            IORequest &req = reqs[i];
+            req.iov.iov_base = req.buf;
+            req.iov.iov_len = req.len;
+
+            unsigned tail = *sq_tail;
+            unsigned index = tail & *sq_mask;
+            struct io_uring_sqe *sqe = &sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req.op == IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->fd = req.fd;
+            sqe->addr = (uint64_t)(uintptr_t)&req.iov;
+            sqe->len = 1;
+            sqe->off = req.offset;
+            sqe->user_data = (uint64_t)(uintptr_t)&req;
+
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            to_submit++;
+        }
+
+        flushSubmissions();
+    }
+
+    void wait()
+    {
+        if (!fallback)
+            flushSubmissions();
+        while (!fallback && inflight > 0)
+            waitForCompletion();
+
+        if (fallback)
+        {
+            // requests the kernel took before the ring was given up still
+            // post their completions
+            reap();
+            while (inflight > 0)
+            {
+                std::this_thread::yield();
+                reap();
+            }
+            fallback->wait();
+        }
+    }
+};
+#endif
+
+// Creates the backend of the requested type. Asynchronous backends prefer
+// io_uring and fall back to a thread pool when the kernel lacks it.
+inline IOBackend *createIOBackend(IOBackendType type)
+{
+    if (type == IO_BACKEND_ASYNC)
+    {
+#ifdef IO_URING_AVAILABLE
+        IOUringBackend *uring = new IOUringBackend();
+        if (uring->isReady())
+            return uring;
+        delete uring;
+#endif
+        return new ThreadPoolIOBackend();
+    }
+
+    return new PosixIOBackend();
+}
+
+#endif
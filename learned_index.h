@@ -0,0 +1,172 @@
+#ifndef LEARNED_INDEX_H
+#define LEARNED_INDEX_H
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+#include <cstdint>
+#include <sys/types.h>
+
+/**
+ *  Piecewise linear model of the key to position mapping of a tree that only
+ *  grows at its end, like the sorted tree of the dual tree. Leaves are added
+ *  in key order once they are sealed, and a key's position is its index among
+ *  all keys added so far. Segments are fit greedily as the keys come in
+ *  (shrinking cone): a segment starts at a key and keeps the range of slopes
+ *  that predict every key it has taken within [error] positions; the first
+ *  key that leaves the range empty starts the next segment. Duplicates of a
+ *  key are predicted at the position of their first copy. Segments are fit
+ *  on the distance of a key from the segment's first key, which is exact for
+ *  64-bit keys as long as it stays below 2^53, whatever the keys themselves.
+ */
+template <typename key_type>
+class LearnedIndex
+{
+    static_assert(std::is_arithmetic<key_type>::value, "the learned index needs numeric keys");
+
+    struct Segment
+    {
+        key_type first_key;
+        unsigned long long first_pos;
+        double slope;
+    };
+
+    int error;
+
+    std::vector<Segment> segments;
+
+    // slopes that keep every key of the last segment within the error
+    double slope_lo;
+    double slope_hi;
+
+    // block id and position of the first key of every leaf
+    std::vector<uint> leaf_ids;
+    std::vector<unsigned long long> leaf_starts;
+
+    unsigned long long num_keys;
+    key_type last_key;
+
+    // distance of [key] from [base] (not larger than [key]); integers are
+    // subtracted before the conversion, which would round large keys
+    static double offset(const key_type &key, const key_type &base, std::true_type)
+    {
+        return (double)((uint64_t)key - (uint64_t)base);
+    }
+
+    static double offset(const key_type &key, const key_type &base, std::false_type)
+    {
+        return (double)key - (double)base;
+    }
+
+    static double offset(const key_type &key, const key_type &base)
+    {
+        return offset(key, base, std::is_integral<key_type>());
+    }
+
+    void addKey(const key_type &key)
+    {
+        unsigned long long pos = num_keys++;
+        if (pos > 0 && !(last_key < key))
+            return;
+        last_key = key;
+
+        if (!segments.empty())
+        {
+            Segment &last = segments.back();
+            double dx = offset(key, last.first_key);
+            double lo = std::max(slope_lo, ((double)pos - error - (double)last.first_pos) / dx);
+            double hi = std::min(slope_hi, ((double)pos + error - (double)last.first_pos) / dx);
+            if (lo <= hi)
+            {
+                slope_lo = lo;
+                slope_hi = hi;
+                last.slope = (lo + hi) / 2;
+                return;
+            }
+        }
+
+        Segment next;
+        next.first_key = key;
+        next.first_pos = pos;
+        next.slope = 0;
+        segments.push_back(next);
+        slope_lo = 0;
+        slope_hi = std::numeric_limits<double>::infinity();
+    }
+
+public:
+    LearnedIndex(int _error) : error(_error), num_keys(0) {}
+
+    /**
+     *  returns: N/A
+     *  Function: appends the leaf [id] that holds [n] keys, read with
+     *  key_at(i), after the leaves added so far. Its keys must not be
+     *  smaller than theirs.
+     */
+    template <typename KeyAt>
+    void addLeaf(uint id, int n, KeyAt key_at)
+    {
+        if (n == 0)
+            return;
+
+        leaf_ids.push_back(id);
+        leaf_starts.push_back(num_keys);
+        for (int i = 0; i < n; i++)
+            addKey(key_at(i));
+    }
+
+    /**
+     *  returns: false if [key] is outside the keys of the model
+     *  Function: sets [lo, hi) to the positions that can hold [key]
+     */
+    bool locate(const key_type &key, unsigned long long &lo, unsigned long long &hi)
+    {
+        if (segments.empty() || key < segments[0].first_key || last_key < key)
+            return false;
+
+        // last segment starting at or before the key
+        int s = 0, len = segments.size();
+        while (len > 1)
+        {
+            int half = len >> 1;
+            s = key < segments[s + half].first_key ? s : s + half;
+            len -= half;
+        }
+
+        const Segment &seg = segments[s];
+        double pos = seg.first_pos + seg.slope * offset(key, seg.first_key);
+
+        // one more position on either side covers rounding
+        double first = pos - error - 1;
+        lo = first > 0 ? (unsigned long long)first : 0;
+        hi = std::min(num_keys, (unsigned long long)(pos + error + 2));
+        return lo < hi;
+    }
+
+    // index of the leaf that holds position [pos]
+    int leafOf(unsigned long long pos)
+    {
+        return std::upper_bound(leaf_starts.begin(), leaf_starts.end(), pos) - leaf_starts.begin() - 1;
+    }
+
+    uint getLeafId(int leaf) { return leaf_ids[leaf]; }
+
+    unsigned long long getLeafStart(int leaf) { return leaf_starts[leaf]; }
+
+    unsigned long long getLeafEnd(int leaf) { return leaf + 1 < (int)leaf_starts.size() ? leaf_starts[leaf + 1] : num_keys; }
+
+    int getNumLeaves() { return leaf_ids.size(); }
+
+    int getNumSegments() { return segments.size(); }
+
+    void clear()
+    {
+        segments.clear();
+        leaf_ids.clear();
+        leaf_starts.clear();
+        num_keys = 0;
+    }
+};
+
+#endif
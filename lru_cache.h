@@ -4,8 +4,25 @@
 #include <cstdint>
 #include <unordered_map>
 #include <vector>
+#include <atomic>
 #include <bits/stdc++.h>
 
+// identifies a cached block. Wide enough to hold an owner tag next to the
+// block id when several block managers share one cache.
+typedef uint64_t cache_key;
+
+// replacement policies the cache can run with
+enum CachePolicy
+{
+    // evicts the least recently used block
+    CACHE_LRU,
+    // 2Q: blocks seen once wait in a small queue and only blocks referenced again
+    // after leaving it reach the main LRU, so scans do not flush hot blocks
+    CACHE_2Q,
+    // second chance FIFO with a reference bit, hits do not reorder anything
+    CACHE_CLOCK,
+};
+
 class Element
 {
     // node id
@@ -24,27 +41,57 @@ public:
 class Node
 {
 public:
-    uint id;
+    // written under the cache's latch, but read without it by users that
+    // kept a reference to the node (see LRUCache::tryAcquire)
+    std::atomic<cache_key> id;
     uint pos;
     Node *prev, *next;
 
-    Node(uint _id, uint _pos) : id(_id), pos(_pos)
+    // policy specific state: the queue of the node for 2Q, the reference bit
+    // for CLOCK
+    unsigned char queue;
+    unsigned char referenced;
+
+    // pinned nodes are taken out of the policy. Nodes in use (pins counts
+    // their users) stay in it, but are skipped by evict(). A user may drop
+    // its pin without holding the cache's latch.
+    unsigned char pinned;
+    std::atomic<uint> pins;
+
+    // state of the frame at pos, kept by the buffer pool: modified since it
+    // was last written, and being read or written right now. A new element
+    // is in flight until the pool has filled its frame.
+    unsigned char dirty;
+    std::atomic<unsigned char> in_flight;
+
+    // used through a kept reference since the policy last saw it; such uses
+    // do not reach the policy, so the node gets a second chance at eviction
+    std::atomic<unsigned char> touched;
+
+    // references to the frames of the children of the block in the frame,
+    // by child slot, kept by the buffer pool (pointer swizzling)
+    std::atomic<std::atomic<Node *> *> swizzled;
+
+    Node(cache_key _id, uint _pos) : id(_id), pos(_pos), queue(0), referenced(0), pinned(0), pins(0), dirty(0), in_flight(0), touched(0), swizzled(nullptr)
     {
         prev = nullptr;
         next = nullptr;
     }
 
-    int getId() { return id; }
+    cache_key getId() { return id; }
     int getPos() { return pos; }
 };
 
+// doubly linked list of nodes between two sentinels. The list does not own
+// its nodes.
 class LinkedList
 {
     Node *begin;
     Node *end;
+    uint size;
 
 public:
-    LinkedList()
+    LinkedList() : size(0)
     {
         begin = new Node(-1, -1);
         end = new Node(-1, -1);
@@ -59,58 +106,523 @@ public:
         delete end;
     }
 
+    void pushFront(Node *node)
+    {
+        node->next = begin->next;
+        node->prev = begin;
+        begin->next->prev = node;
+        begin->next = node;
+        size++;
+    }
+
+    void unlink(Node *node)
+    {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = nullptr;
+        node->next = nullptr;
+        size--;
+    }
+
     void moveToFront(Node *node)
     {
-        if (node->prev)
+        unlink(node);
+        pushFront(node);
+    }
+
+    void moveToBack(Node *node)
+    {
+        unlink(node);
+
+        node->prev = end->prev;
+        node->next = end;
+        end->prev->next = node;
+        end->prev = node;
+        size++;
+    }
+
+    Node *getEndNode()
+    {
+        if (end->prev == begin)
         {
-            node->prev->next = node->next;
+            return nullptr;
         }
 
-        if (node->next)
+        return end->prev;
+    }
+
+    // the node in front of [node], nullptr at the front of the list
+    Node *getPrevNode(Node *node)
+    {
+        if (node->prev == begin)
         {
-            node->next->prev = node->prev;
+            return nullptr;
         }
 
-        // add to front
-        node->next = begin->next;
-        node->prev = begin;
-        begin->next->prev = node;
-        begin->next = node;
+        return node->prev;
     }
 
-    Node *addToFront(uint id, uint pos)
+    uint getSize() { return size; }
+};
+
+// Flat open-addressing hash table from ids to positions. Linear probing,
+// deletions shift the following entries back instead of leaving tombstones.
+// Id 0 marks an empty slot and cannot be stored. Used by the cache for its
+// slots and by the 2Q policy for its ghost keys.
+class PositionIndex
+{
+    struct Entry
     {
-        Node *node = new Node(id, pos);
-        moveToFront(node);
+        cache_key id;
+        uint pos;
+    };
 
-        return node;
+    std::vector<Entry> table;
+    size_t mask;
+    size_t size;
+
+    size_t slotOf(cache_key id)
+    {
+        // 64-bit multiplicative hashing, the high bits are the best mixed
+        return (size_t)((id * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
     }
 
-    void removeFromEnd()
+    void rehash(size_t slots)
     {
-        if (end->prev == begin)
+        std::vector<Entry> old;
+        old.swap(table);
+
+        Entry empty = {0, 0};
+        table.assign(slots, empty);
+        mask = slots - 1;
+        size = 0;
+
+        for (size_t i = 0; i < old.size(); i++)
+        {
+            if (old[i].id != 0)
+                insert(old[i].id, old[i].pos);
+        }
+    }
+
+public:
+    static const uint NOT_FOUND = UINT32_MAX;
+
+    PositionIndex(uint expected) : mask(0), size(0) { reserve(expected); }
+
+    // makes room for [expected] ids at a load factor of at most one half
+    void reserve(size_t expected)
+    {
+        size_t slots = 16;
+        while (slots < 2 * expected)
+            slots *= 2;
+        if (slots > table.size())
+            rehash(slots);
+    }
+
+    uint find(cache_key id)
+    {
+        for (size_t slot = slotOf(id);; slot = (slot + 1) & mask)
+        {
+            if (table[slot].id == id)
+                return table[slot].pos;
+            if (table[slot].id == 0)
+                return NOT_FOUND;
+        }
+    }
+
+    void insert(cache_key id, uint pos)
+    {
+        assert(id != 0);
+        if (2 * (size + 1) > table.size())
+            rehash(2 * table.size());
+
+        size_t slot = slotOf(id);
+        while (table[slot].id != 0 && table[slot].id != id)
+            slot = (slot + 1) & mask;
+
+        if (table[slot].id == 0)
+            size++;
+        table[slot].id = id;
+        table[slot].pos = pos;
+    }
+
+    void erase(cache_key id)
+    {
+        size_t slot = slotOf(id);
+        while (table[slot].id != id)
         {
+            if (table[slot].id == 0)
+                return;
+            slot = (slot + 1) & mask;
+        }
+
+        // move back every following entry of the cluster that would no
+        // longer be found once the slot is empty
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask; table[next].id != 0; next = (next + 1) & mask)
+        {
+            size_t home = slotOf(table[next].id);
+            bool reachable = hole <= next ? (home > hole && home <= next) : (home > hole || home <= next);
+            if (!reachable)
+            {
+                table[hole] = table[next];
+                hole = next;
+            }
+        }
+
+        table[hole].id = 0;
+        size--;
+    }
+};
+
+// Decides which element of the cache is evicted next. The cache owns the
+// nodes and tells the policy about every insert, hit and removal.
+class ReplacementPolicy
+{
+protected:
+    // nodes in use or whose frame is being read or written are never picked
+    // for eviction
+    static bool inUse(Node *node) { return node->pins.load(std::memory_order_acquire) > 0 || node->in_flight.load(std::memory_order_relaxed); }
+
+public:
+    virtual ~ReplacementPolicy() {}
+
+    virtual const char *getName() = 0;
+
+    // a node entered the cache
+    virtual void insert(Node *node) = 0;
+
+    // a resident node was accessed
+    virtual void access(Node *node) = 0;
+
+    // a node leaves the cache without being evicted
+    virtual void remove(Node *node) = 0;
+
+    // a node taken out with remove() while it was pinned comes back. It
+    // keeps its queue and counts as just accessed.
+    virtual void restore(Node *node) = 0;
+
+    // unlinks and returns the node to evict, nullptr if the cache is empty
+    // or every node is in use
+    virtual Node *evict() = 0;
+
+    // the node evict() returned, which held [id], is gone for good. A node
+    // the cache could not give up comes back through restore() instead.
+    virtual void evicted(Node *, cache_key) {}
+
+    // makes [node] one of the next nodes to be evicted
+    virtual void demote(Node *node) = 0;
+
+    // walk over the nodes in the order they would be evicted in
+    virtual Node *coldest() = 0;
+    virtual Node *warmer(Node *node) = 0;
+
+    virtual void setCapacity(uint) {}
+};
+
+class LRUPolicy : public ReplacementPolicy
+{
+    LinkedList list;
+
+public:
+    const char *getName() { return "lru"; }
+
+    void insert(Node *node) { list.pushFront(node); }
+
+    void access(Node *node) { list.moveToFront(node); }
+
+    void remove(Node *node) { list.unlink(node); }
+
+    void restore(Node *node) { list.pushFront(node); }
+
+    Node *evict()
+    {
+        Node *victim = list.getEndNode();
+        while (victim != nullptr && inUse(victim))
+            victim = list.getPrevNode(victim);
+
+        if (victim != nullptr)
+            list.unlink(victim);
+        return victim;
+    }
+
+    void demote(Node *node) { list.moveToBack(node); }
+
+    Node *coldest() { return list.getEndNode(); }
+
+    Node *warmer(Node *node) { return list.getPrevNode(node); }
+};
+
+// CLOCK, kept as a FIFO whose tail is the clock hand. A referenced node at
+// the hand gets its bit cleared and a second round instead of being evicted.
+class ClockPolicy : public ReplacementPolicy
+{
+    LinkedList ring;
+
+public:
+    const char *getName() { return "clock"; }
+
+    void insert(Node *node)
+    {
+        node->referenced = 1;
+        ring.pushFront(node);
+    }
+
+    void access(Node *node) { node->referenced = 1; }
+
+    void remove(Node *node) { ring.unlink(node); }
+
+    void restore(Node *node)
+    {
+        node->referenced = 1;
+        ring.pushFront(node);
+    }
+
+    Node *evict()
+    {
+        // nodes in use get another round like referenced ones; after two
+        // full rounds every node is in use
+        Node *victim = ring.getEndNode();
+        for (uint turns = 0; victim != nullptr && (victim->referenced || inUse(victim)); turns++)
+        {
+            if (turns >= 2 * ring.getSize())
+                return nullptr;
+            victim->referenced = 0;
+            ring.moveToFront(victim);
+            victim = ring.getEndNode();
+        }
+
+        if (victim != nullptr)
+            ring.unlink(victim);
+        return victim;
+    }
+
+    void demote(Node *node)
+    {
+        node->referenced = 0;
+        ring.moveToBack(node);
+    }
+
+    Node *coldest() { return ring.getEndNode(); }
+
+    Node *warmer(Node *node) { return ring.getPrevNode(node); }
+};
+
+// Full 2Q (Johnson and Shasha). New nodes enter the A1in queue. Nodes evicted
+// from A1in leave their key in the A1out ghost queue, and only a node that
+// is referenced again while its key is there enters the Am LRU. A1in is kept
+// at a quarter of the capacity and A1out remembers half the capacity in keys.
+class TwoQueuePolicy : public ReplacementPolicy
+{
+    enum
+    {
+        QUEUE_A1IN,
+        QUEUE_AM,
+    };
+
+    LinkedList a1in;
+    LinkedList am;
+
+    // keys of nodes recently evicted from A1in in a ring of kout slots, the
+    // oldest one is overwritten next. Slots whose key got hit hold 0.
+    std::vector<cache_key> a1out;
+    uint a1out_next;
+
+    // key -> its slot in a1out
+    PositionIndex a1out_index;
+
+    uint kin;
+    uint kout;
+
+    // victims are taken from A1in while it is over its share
+    bool evictFromA1in() { return a1in.getSize() > kin || am.getSize() == 0; }
+
+    LinkedList &queueOf(Node *node) { return node->queue == QUEUE_AM ? am : a1in; }
+
+public:
+    TwoQueuePolicy(uint _capacity) : a1out_next(0), a1out_index(0) { setCapacity(_capacity); }
+
+    const char *getName() { return "2q"; }
+
+    void setCapacity(uint _capacity)
+    {
+        kin = std::max(1u, _capacity / 4);
+        kout = std::max(1u, _capacity / 2);
+        if (kout == a1out.size())
             return;
+
+        // keep the most recent keys that still fit, oldest first
+        std::vector<cache_key> keys;
+        for (size_t i = 0; i < a1out.size(); i++)
+        {
+            cache_key id = a1out[(a1out_next + i) % a1out.size()];
+            if (id != 0)
+                keys.push_back(id);
+        }
+        if (keys.size() > kout)
+            keys.erase(keys.begin(), keys.end() - kout);
+
+        for (size_t i = 0; i < a1out.size(); i++)
+        {
+            if (a1out[i] != 0)
+                a1out_index.erase(a1out[i]);
+        }
+        a1out.assign(kout, 0);
+        a1out_index.reserve(kout);
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            a1out[i] = keys[i];
+            a1out_index.insert(keys[i], i);
         }
+        a1out_next = keys.size() % kout;
+    }
 
-        Node *temp = end->prev;
-        end->prev->prev->next = end;
-        end->prev = end->prev->prev;
+    void insert(Node *node)
+    {
+        uint slot = a1out_index.find(node->id);
+        if (slot != PositionIndex::NOT_FOUND)
+        {
+            a1out[slot] = 0;
+            a1out_index.erase(node->id);
+            node->queue = QUEUE_AM;
+            am.pushFront(node);
+            return;
+        }
 
-        delete temp;
+        node->queue = QUEUE_A1IN;
+        a1in.pushFront(node);
     }
 
-    Node *getEndNode()
+    void access(Node *node)
     {
-        if (end->prev == begin)
+        // hits in A1in are correlated references and do not promote the
+        // node. They still refresh it, since tree operations rely on the
+        // nodes they opened last staying in memory.
+        queueOf(node).moveToFront(node);
+    }
+
+    void remove(Node *node) { queueOf(node).unlink(node); }
+
+    void restore(Node *node) { queueOf(node).pushFront(node); }
+
+    // coldest node of [queue] that is not in use
+    static Node *victimOf(LinkedList &queue)
+    {
+        Node *victim = queue.getEndNode();
+        while (victim != nullptr && inUse(victim))
+            victim = queue.getPrevNode(victim);
+        return victim;
+    }
+
+    Node *evict()
+    {
+        Node *victim = nullptr;
+        if (!evictFromA1in())
         {
-            return nullptr;
+            victim = victimOf(am);
+            if (victim != nullptr)
+            {
+                am.unlink(victim);
+                return victim;
+            }
         }
 
-        return end->prev;
+        victim = victimOf(a1in);
+        if (victim == nullptr)
+        {
+            // everything in A1in is in use
+            victim = victimOf(am);
+            if (victim != nullptr)
+                am.unlink(victim);
+            return victim;
+        }
+
+        a1in.unlink(victim);
+        return victim;
+    }
+
+    // only nodes evicted from A1in leave their key in A1out
+    void evicted(Node *node, cache_key id)
+    {
+        if (node->queue != QUEUE_A1IN)
+            return;
+
+        // a key is remembered once, in its most recent slot
+        uint old_slot = a1out_index.find(id);
+        if (old_slot != PositionIndex::NOT_FOUND)
+            a1out[old_slot] = 0;
+
+        cache_key oldest = a1out[a1out_next];
+        if (oldest != 0)
+            a1out_index.erase(oldest);
+        a1out[a1out_next] = id;
+        a1out_index.insert(id, a1out_next);
+        a1out_next = (a1out_next + 1) % kout;
+    }
+
+    void demote(Node *node)
+    {
+        queueOf(node).moveToBack(node);
+    }
+
+    Node *coldest()
+    {
+        Node *node = evictFromA1in() ? a1in.getEndNode() : am.getEndNode();
+        if (node == nullptr)
+            node = evictFromA1in() ? am.getEndNode() : a1in.getEndNode();
+        return node;
+    }
+
+    Node *warmer(Node *node)
+    {
+        Node *next = queueOf(node).getPrevNode(node);
+        if (next != nullptr)
+            return next;
+
+        // continue with the queue victims are taken from second
+        bool in_first = (node->queue == QUEUE_A1IN) == evictFromA1in();
+        if (!in_first)
+            return nullptr;
+        return node->queue == QUEUE_A1IN ? am.getEndNode() : a1in.getEndNode();
     }
 };
 
+inline ReplacementPolicy *createReplacementPolicy(CachePolicy policy, uint capacity)
+{
+    switch (policy)
+    {
+    case CACHE_2Q:
+        return new TwoQueuePolicy(capacity);
+    case CACHE_CLOCK:
+        return new ClockPolicy();
+    default:
+        return new LRUPolicy();
+    }
+}
+
+// parses "lru", "2q" or "clock", returns false for anything else
+inline bool parseCachePolicy(const std::string &name, CachePolicy &policy)
+{
+    if (name == "lru")
+        policy = CACHE_LRU;
+    else if (name == "2q")
+        policy = CACHE_2Q;
+    else if (name == "clock")
+        policy = CACHE_CLOCK;
+    else
+        return false;
+    return true;
+}
+
+// number of descriptors allocated at a time, so that their addresses stay
+// stable when the cache grows
+#define CACHE_DESC_CHUNK 512
+
+// Maps ids to positions of a fixed number of slots. Which id gives up its
+// slot when the cache is full is up to the replacement policy (LRU unless
+// chosen otherwise). Every position has a preallocated descriptor that
+// carries the policy's links, and ids are found through a flat hash table,
+// so neither hits nor misses allocate memory.
 class LRUCache
 {
     // denotes capacity of the cache
@@ -119,82 +631,347 @@ class LRUCache
     // denotes current size of cache
     uint size;
 
-    // elements of the cache
-    LinkedList *list;
+    // number of pinned elements, counted in size
+    uint num_pinned;
 
-    std::unordered_map<uint, Node *> node_hash;
+    // orders the elements of the cache for eviction
+    ReplacementPolicy *policy;
 
-public:
-    LRUCache(uint _cap) : capacity(_cap), size(0)
+    // id -> position
+    PositionIndex index;
+
+    // descriptor of every position handed out so far, id 0 if unused
+    std::vector<Node *> desc_chunks;
+
+    // positions given up through remove(), handed out again before new ones
+    std::vector<uint> free_positions;
+
+    // next position that has never been handed out
+    uint next_pos;
+
+    // pinned elements are not in the policy
+    static bool evictable(Node *node) { return !node->pinned; }
+
+    Node *newPosition()
     {
-        list = new LinkedList();
+        uint pos = next_pos++;
+        if (pos / CACHE_DESC_CHUNK >= desc_chunks.size())
+        {
+            Node *chunk = static_cast<Node *>(::operator new(CACHE_DESC_CHUNK * sizeof(Node)));
+            for (uint i = 0; i < CACHE_DESC_CHUNK; i++)
+                new (&chunk[i]) Node(0, pos + i);
+            desc_chunks.push_back(chunk);
+        }
+        return getNode(pos);
     }
 
-    ~LRUCache()
+    /**
+     *  returns: a node the policy gave up, with its id cleared and returned in
+     *  [old_id], or nullptr if every node is pinned or in use
+     *  Function: users holding a reference may take a node without the latch
+     *  (see tryAcquire). The victim's id is cleared before its use count is
+     *  checked, so such a user either sees the change or is seen here and the
+     *  victim is spared. Victims used that way since the policy last saw them
+     *  get a second chance.
+     */
+    Node *claimVictim(cache_key &old_id)
     {
-        for (std::unordered_map<uint, Node *>::iterator it = node_hash.begin(); it != node_hash.end(); ++it)
+        for (uint tries = 0; tries <= 2 * size; tries++)
         {
-            delete it->second;
+            Node *node = policy->evict();
+            if (node == nullptr)
+                return nullptr;
+
+            if (node->touched.exchange(0, std::memory_order_relaxed))
+            {
+                policy->restore(node);
+                continue;
+            }
+
+            // frames being read or written stay put, whatever the policy
+            // thinks of them
+            old_id = node->id;
+            node->id = 0;
+            if (node->pins.load() > 0 || node->in_flight.load())
+            {
+                node->id = old_id;
+                policy->restore(node);
+                continue;
+            }
+            policy->evicted(node, old_id);
+            return node;
         }
+        return nullptr;
+    }
+
+public:
+    // position returned for ids that are not in the cache
+    static const uint NOT_FOUND = UINT32_MAX;
+
+    LRUCache(uint _cap, CachePolicy _policy = CACHE_LRU) : capacity(_cap), size(0), num_pinned(0), index(_cap), next_pos(0)
+    {
+        policy = createReplacementPolicy(_policy, capacity);
+    }
+
+    ~LRUCache()
+    {
+        for (size_t i = 0; i < desc_chunks.size(); i++)
+            ::operator delete(desc_chunks[i]);
 
-        delete list;
+        delete policy;
     }
 
-    uint get(uint id)
+    // descriptor of a position below getPositions(); its id is 0 if unused
+    Node *getNode(uint pos) { return &desc_chunks[pos / CACHE_DESC_CHUNK][pos % CACHE_DESC_CHUNK]; }
+
+    // number of positions handed out so far
+    uint getPositions() { return next_pos; }
+
+    uint get(cache_key id)
     {
-        std::unordered_map<uint, Node *>::iterator it = node_hash.find(id);
+        uint pos = index.find(id);
 
-        if (it == node_hash.end())
+        if (pos == NOT_FOUND)
         {
-            return capacity + 1;
+            return NOT_FOUND;
         }
 
-        list->moveToFront(it->second);
+        Node *node = getNode(pos);
+        if (evictable(node))
+            policy->access(node);
+
+        return pos;
+    }
+
+    // returns the position of [id] without touching the recency order
+    uint peek(cache_key id)
+    {
+        return index.find(id);
+    }
 
-        return it->second->pos;
+    // checks residency without touching the recency order
+    bool contains(cache_key id)
+    {
+        return index.find(id) != NOT_FOUND;
     }
 
-    uint put(uint id, uint *evicted_id)
+    // if every element is pinned or in use, a full cache takes a new position
+    // instead of evicting and grows past its capacity until evict() is called.
+    // The new element is in flight.
+    uint put(cache_key id, cache_key *evicted_id)
     {
         uint pos = get(id);
 
-        if (pos >= capacity)
+        if (pos == NOT_FOUND)
         {
-            if (size == capacity)
+            Node *node = nullptr;
+            cache_key old_id = 0;
+            if (size >= capacity)
+                node = claimVictim(old_id);
+
+            if (node != nullptr)
             {
-                Node *evicted = list->getEndNode();
-                pos = evicted->pos;
                 if (evicted_id)
                 {
-                    *evicted_id = evicted->id;
+                    *evicted_id = old_id;
                 }
-                node_hash.erase(evicted->id);
-                list->removeFromEnd();
+                index.erase(old_id);
                 --size;
             }
             else
             {
-                *evicted_id = 0;
-                pos = size;
+                if (evicted_id)
+                {
+                    *evicted_id = 0;
+                }
+                if (!free_positions.empty())
+                {
+                    node = getNode(free_positions.back());
+                    free_positions.pop_back();
+                }
+                else
+                {
+                    node = newPosition();
+                }
             }
 
-            Node *node = list->addToFront(id, pos);
+            // in flight before the id is visible to users without the latch
+            node->in_flight = 1;
+            node->id = id;
+            policy->insert(node);
             ++size;
-            node_hash[id] = node;
+            index.insert(id, node->pos);
+            pos = node->pos;
         }
 
         return pos;
     }
 
-    std::unordered_map<uint, Node *>::iterator getBegin()
+    // makes [id] one of the next elements to be evicted
+    void demote(cache_key id)
+    {
+        uint pos = index.find(id);
+
+        if (pos == NOT_FOUND || !evictable(getNode(pos)))
+            return;
+
+        policy->demote(getNode(pos));
+    }
+
+    // keeps the element at [pos] in the cache while it is used; uses nest.
+    // The use ends with release(), which needs no latch.
+    void acquire(uint pos) { acquire(getNode(pos)); }
+
+    // another use of an element that is in use already
+    static void acquire(Node *node)
+    {
+        node->pins.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void release(Node *node)
+    {
+        assert(node->pins.load(std::memory_order_relaxed) > 0);
+        node->pins.fetch_sub(1, std::memory_order_release);
+    }
+
+    static bool inUse(Node *node) { return node->pins.load(std::memory_order_acquire) > 0; }
+
+    /**
+     *  returns: true if [node] holds [id] and is now in use by the caller
+     *  Function: takes a node through a reference kept from an earlier
+     *  lookup, without the latch. Fails if the node was evicted or reused
+     *  since, or its frame is still being filled.
+     */
+    static bool tryAcquire(Node *node, cache_key id)
+    {
+        node->pins.fetch_add(1);
+        if (node->id.load() != id || node->in_flight.load())
+        {
+            release(node);
+            return false;
+        }
+        node->touched.store(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     *  returns: false if [id] is not in the cache
+     *  Function: keeps [id] in the cache until unpin() is called. Pinned
+     *  elements still take a position, but the policy does not see them.
+     */
+    bool pin(cache_key id)
+    {
+        uint pos = index.find(id);
+
+        if (pos == NOT_FOUND)
+            return false;
+
+        Node *node = getNode(pos);
+        if (!node->pinned)
+        {
+            if (evictable(node))
+                policy->remove(node);
+            node->pinned = 1;
+            num_pinned++;
+        }
+        return true;
+    }
+
+    // hands [id] back to the policy as the most recently used element
+    void unpin(cache_key id)
+    {
+        uint pos = index.find(id);
+
+        if (pos == NOT_FOUND || !getNode(pos)->pinned)
+            return;
+
+        Node *node = getNode(pos);
+        node->pinned = 0;
+        num_pinned--;
+        if (evictable(node))
+            policy->restore(node);
+    }
+
+    bool isPinned(cache_key id)
     {
-        return node_hash.begin();
+        uint pos = index.find(id);
+        return pos != NOT_FOUND && getNode(pos)->pinned;
     }
 
-    std::unordered_map<uint, Node *>::iterator getEnd()
+    uint getNumPinned() { return num_pinned; }
+
+    // drops [id] from the cache, its position becomes free
+    void remove(cache_key id)
+    {
+        uint pos = index.find(id);
+
+        if (pos == NOT_FOUND)
+            return;
+
+        Node *node = getNode(pos);
+        node->id = 0;
+        if (node->pinned)
+            num_pinned--;
+        if (evictable(node))
+            policy->remove(node);
+        index.erase(id);
+        node->pinned = 0;
+        node->touched = 0;
+        free_positions.push_back(pos);
+        --size;
+    }
+
+    // evicts the element the policy picks. Returns false if the cache is empty
+    bool evict(cache_key *evicted_id, uint *evicted_pos)
+    {
+        cache_key old_id;
+        Node *evicted = claimVictim(old_id);
+        if (evicted == nullptr)
+            return false;
+
+        *evicted_id = old_id;
+        *evicted_pos = evicted->pos;
+        index.erase(old_id);
+        free_positions.push_back(evicted->pos);
+        --size;
+        return true;
+    }
+
+    // walks the cache in eviction order, from the next victim onwards
+    Node *getLeastRecent() { return policy->coldest(); }
+
+    Node *getMoreRecent(Node *node) { return policy->warmer(node); }
+
+    uint getSize() { return size; }
+
+    uint getCapacity() { return capacity; }
+
+    // a smaller capacity takes effect on the next put(); callers that need the
+    // memory back right away evict() down to the new size themselves
+    void setCapacity(uint _cap)
+    {
+        capacity = _cap;
+        index.reserve(capacity);
+        policy->setCapacity(capacity);
+    }
+
+    const char *getPolicyName() { return policy->getName(); }
+
+    // switches to another replacement policy. Resident elements are handed to
+    // the new policy from the coldest to the hottest one, pinned ones stay
+    // out of it.
+    void setPolicy(CachePolicy _policy)
     {
-        return node_hash.end();
+        std::vector<Node *> nodes;
+        nodes.reserve(size);
+        for (Node *node = policy->coldest(); node != nullptr; node = policy->warmer(node))
+            nodes.push_back(node);
+
+        delete policy;
+        policy = createReplacementPolicy(_policy, capacity);
+        for (size_t i = 0; i < nodes.size(); i++)
+            policy->insert(nodes[i]);
     }
 };
 
-#endif
\ No newline at end of file
+#endif
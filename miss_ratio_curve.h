@@ -0,0 +1,238 @@
+#ifndef MISS_RATIO_CURVE_H
+#define MISS_RATIO_CURVE_H
+
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <mutex>
+
+// the sampling hash is compared against a threshold out of 2^MRC_HASH_BITS
+#define MRC_HASH_BITS 24
+
+// initial number of access times the distance tree can hold
+#define MRC_MIN_TIMES 1024
+
+// reuse distances are kept in steps of 1 / (rate * MRC_STEPS_PER_SAMPLE)
+// blocks, finer than one sampled leaf so that short distances made up of
+// internal nodes are told apart
+#define MRC_STEPS_PER_SAMPLE 8
+
+// kinds of blocks the curve is kept for
+enum BlockClass
+{
+    BLOCK_LEAF,
+    BLOCK_INTERNAL,
+    BLOCK_ANY,
+};
+
+/**
+ *  Estimates the miss ratio curve of an LRU cache from a sample of the block
+ *  accesses (spatially hashed sampling, "SHARDS"). A leaf is sampled if a hash
+ *  of its id falls below the sampling rate, so either every access to a leaf
+ *  is seen or none is. Internal nodes are few and hot, so all of them are
+ *  tracked. For a tracked access, the reuse distance is the number of
+ *  distinct blocks accessed since the previous access to the same block,
+ *  with every sampled leaf standing for 1 / rate leaves. An LRU cache of C
+ *  blocks hits exactly the accesses with a reuse distance below C, so a
+ *  histogram of the distances gives the hit ratio of every cache size at once.
+ */
+class MissRatioCurve
+{
+    struct Access
+    {
+        uint time;
+        unsigned char cls;
+    };
+
+    double rate;
+    uint64_t threshold;
+
+    std::mutex latch;
+
+    // last access time and class of every tracked block, and a Fenwick tree
+    // per class over the access times with a 1 at the last access time of
+    // every block
+    std::unordered_map<uint, Access> last_access;
+    std::vector<uint> times[2];
+    uint now;
+
+    // histograms of the reuse distances of leaf and internal blocks (in steps,
+    // see MRC_STEPS_PER_SAMPLE), their first accesses (cold misses) and the
+    // number of accesses tracked
+    std::vector<unsigned long long> distances[2];
+    unsigned long long cold[2];
+    unsigned long long accesses[2];
+
+    void addTime(int cls, uint t, int delta)
+    {
+        for (; t < times[cls].size(); t += t & (~t + 1))
+            times[cls][t] += delta;
+    }
+
+    // number of blocks of class [cls] whose last access was at time t or earlier
+    uint countUpTo(int cls, uint t)
+    {
+        uint sum = 0;
+        for (; t > 0; t -= t & (~t + 1))
+            sum += times[cls][t];
+        return sum;
+    }
+
+    // renumbers the last access times 1..n in order once the trees are full,
+    // keeping room for as many accesses again
+    void compact()
+    {
+        std::vector<std::pair<uint, uint>> order;
+        order.reserve(last_access.size());
+        for (std::unordered_map<uint, Access>::iterator it = last_access.begin(); it != last_access.end(); ++it)
+            order.push_back(std::make_pair(it->second.time, it->first));
+        std::sort(order.begin(), order.end());
+
+        for (int c = 0; c < 2; c++)
+            times[c].assign(std::max((size_t)MRC_MIN_TIMES, 2 * order.size() + 2), 0);
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            Access &last = last_access[order[i].second];
+            last.time = i + 1;
+            addTime(last.cls, i + 1, 1);
+        }
+        now = order.size();
+    }
+
+    // weight of one tracked access of class [cls] among all accesses
+    double weight(int cls) { return cls == BLOCK_LEAF ? 1.0 / rate : 1.0; }
+
+public:
+    MissRatioCurve(double _rate) : rate(_rate), now(0)
+    {
+        rate = std::min(1.0, std::max(1.0 / (1 << MRC_HASH_BITS), rate));
+        threshold = (uint64_t)(rate * (1 << MRC_HASH_BITS));
+        for (int c = 0; c < 2; c++)
+        {
+            times[c].assign(MRC_MIN_TIMES, 0);
+            cold[c] = 0;
+            accesses[c] = 0;
+        }
+    }
+
+    bool isSampled(uint id, bool is_leaf)
+    {
+        return !is_leaf || (((uint64_t)id * 0x9E3779B97F4A7C15ULL) >> (64 - MRC_HASH_BITS)) < threshold;
+    }
+
+    // records an access to block [id]; cheap for leaves outside the sample
+    void access(uint id, bool is_leaf)
+    {
+        if (!isSampled(id, is_leaf))
+            return;
+
+        int cls = is_leaf ? BLOCK_LEAF : BLOCK_INTERNAL;
+        std::lock_guard<std::mutex> guard(latch);
+        accesses[cls]++;
+
+        if (now + 1 >= times[0].size())
+            compact();
+        uint t = ++now;
+
+        std::unordered_map<uint, Access>::iterator it = last_access.find(id);
+        if (it == last_access.end())
+        {
+            cold[cls]++;
+            Access last;
+            last.time = t;
+            last.cls = cls;
+            last_access[id] = last;
+        }
+        else
+        {
+            // distinct blocks accessed after the previous access to this one
+            uint leaves = countUpTo(BLOCK_LEAF, now) - countUpTo(BLOCK_LEAF, it->second.time);
+            uint internals = countUpTo(BLOCK_INTERNAL, now) - countUpTo(BLOCK_INTERNAL, it->second.time);
+            size_t distance = (size_t)((leaves + internals * rate) * MRC_STEPS_PER_SAMPLE);
+            if (distance >= distances[cls].size())
+                distances[cls].resize(distance + 1, 0);
+            distances[cls][distance]++;
+
+            addTime(it->second.cls, it->second.time, -1);
+            it->second.time = t;
+            it->second.cls = cls;
+        }
+        addTime(cls, t, 1);
+    }
+
+    // forgets a block, e.g. because it was freed
+    void forget(uint id)
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        std::unordered_map<uint, Access>::iterator it = last_access.find(id);
+        if (it == last_access.end())
+            return;
+        addTime(it->second.cls, it->second.time, -1);
+        last_access.erase(it);
+    }
+
+    double getSampleRate() { return rate; }
+
+    /**
+     *  returns: estimated hit ratio of an LRU cache of [cache_blocks] blocks
+     *  for accesses to blocks of class [cls]
+     *  Function: counts the tracked accesses whose reuse distance is below the
+     *  cache size, leaves weighted by 1 / rate. Cold misses count as misses.
+     */
+    double predictHitRatio(uint cache_blocks, BlockClass cls = BLOCK_ANY)
+    {
+        std::lock_guard<std::mutex> guard(latch);
+        size_t limit = (size_t)(cache_blocks * rate * MRC_STEPS_PER_SAMPLE + 0.5);
+
+        double hits = 0, total = 0;
+        for (int c = 0; c < 2; c++)
+        {
+            if (cls != BLOCK_ANY && cls != c)
+                continue;
+            unsigned long long class_hits = 0;
+            for (size_t d = 0; d < limit && d < distances[c].size(); d++)
+                class_hits += distances[c][d];
+            hits += class_hits * weight(c);
+            total += accesses[c] * weight(c);
+        }
+        return total > 0 ? hits / total : 0.0;
+    }
+
+    /**
+     *  returns: the smallest cache size, in blocks, estimated to reach
+     *  [target] hit ratio for blocks of class [cls], or 0 if no cache size does
+     *  (too many cold misses)
+     */
+    uint getBlocksForHitRatio(double target, BlockClass cls = BLOCK_ANY)
+    {
+        std::lock_guard<std::mutex> guard(latch);
+
+        double total = 0;
+        size_t max_distance = 0;
+        for (int c = 0; c < 2; c++)
+        {
+            if (cls != BLOCK_ANY && cls != c)
+                continue;
+            total += accesses[c] * weight(c);
+            max_distance = std::max(max_distance, distances[c].size());
+        }
+        if (total == 0)
+            return 0;
+
+        double hits = 0;
+        for (size_t d = 0; d < max_distance; d++)
+        {
+            for (int c = 0; c < 2; c++)
+            {
+                if ((cls == BLOCK_ANY || cls == c) && d < distances[c].size())
+                    hits += distances[c][d] * weight(c);
+            }
+            if (hits / total >= target)
+                return (uint)((d + 1) / (rate * MRC_STEPS_PER_SAMPLE) + 0.5);
+        }
+        return 0;
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "betree.h"
+
+// compares the node search kernels of search_kernels.h against the searches
+// they replaced, at the node sizes given by the default knobs
+
+#define BENCH_LOOKUPS 2000000
+#define BENCH_COLD_NODES 16384
+
+// branchy binary search BeNode::slotOfKey used before
+template <typename key_type>
+int binarySlot(const key_type *keys, int n, key_type key)
+{
+    int lo = 0, hi = n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) >> 1;
+        if (key <= keys[mid])
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+template <typename F>
+double nanosPerLookup(F lookup, long long &checksum)
+{
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < BENCH_LOOKUPS; i++)
+        checksum += lookup(i);
+    auto stop = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / BENCH_LOOKUPS;
+}
+
+// every node sits in a block of its own, like in the buffer pool; lookups go
+// to one node (hot in the CPU caches) or spread over BENCH_COLD_NODES nodes
+// (64 MB, mostly missing the caches)
+template <typename element>
+struct NodeSet
+{
+    std::vector<element> blocks;
+    int per_block;
+    int num_nodes;
+
+    NodeSet(int _num_nodes) : per_block(BLOCK_SIZE_BYTES / sizeof(element)), num_nodes(_num_nodes)
+    {
+        blocks.resize((size_t)per_block * num_nodes);
+    }
+
+    element *node(int i) { return &blocks[(size_t)per_block * i]; }
+
+    // node probed by lookup [i]
+    element *pick(int i) { return node((int)(((unsigned)i * 2654435761u) % num_nodes)); }
+};
+
+template <typename key_type>
+void benchKeys(const char *type_name, const char *what, int n, int num_nodes)
+{
+    std::mt19937_64 rng(n);
+    std::vector<key_type> sorted(n);
+    for (int i = 0; i < n; i++)
+        sorted[i] = (key_type)(rng() % (20 * (unsigned long long)n));
+    std::sort(sorted.begin(), sorted.end());
+
+    // the same keys in Eytzinger order (PIVOTS_EYTZINGER)
+    NodeSet<key_type> keys(num_nodes), eytzinger(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+    {
+        std::copy(sorted.begin(), sorted.end(), keys.node(i));
+        toEytzinger(sorted.data(), eytzinger.node(i), n);
+    }
+
+    std::vector<key_type> probes(4096);
+    for (size_t i = 0; i < probes.size(); i++)
+        probes[i] = (key_type)(rng() % (20 * (unsigned long long)n));
+
+    long long checksum = 0, expected = 0, eytzinger_checksum = 0;
+    double before = nanosPerLookup([&](int i) { return binarySlot(keys.pick(i), n, probes[i & 4095]); }, expected);
+    double after = nanosPerLookup([&](int i) { return searchKeys(keys.pick(i), n, probes[i & 4095]); }, checksum);
+    double tree = nanosPerLookup([&](int i) { return searchEytzinger(eytzinger.pick(i), n, probes[i & 4095]); }, eytzinger_checksum);
+
+    std::cout << what << " " << type_name << " n=" << n << (num_nodes > 1 ? " cold" : " hot ") << ": binary " << before << " ns, "
+              << KeyCounter<key_type>::getName() << " " << after << " ns, eytzinger " << tree << " ns"
+              << (checksum == expected && eytzinger_checksum == expected ? "" : "  MISMATCH") << std::endl;
+}
+
+template <typename key_type>
+void benchPairs(const char *type_name, const char *what, int n, int num_nodes)
+{
+    std::mt19937_64 rng(n);
+    std::vector<std::pair<key_type, key_type>> sorted(n);
+    for (int i = 0; i < n; i++)
+        sorted[i] = std::make_pair((key_type)(rng() % (2 * (unsigned long long)n)), (key_type)i);
+    std::sort(sorted.begin(), sorted.end());
+
+    NodeSet<std::pair<key_type, key_type>> pairs(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        std::copy(sorted.begin(), sorted.end(), pairs.node(i));
+
+    std::vector<key_type> probes(4096);
+    for (size_t i = 0; i < probes.size(); i++)
+        probes[i] = (key_type)(rng() % (2 * (unsigned long long)n));
+
+    long long checksum = 0, expected = 0;
+    double before = nanosPerLookup([&](int i) { std::pair<key_type, key_type> *node = pairs.pick(i); return std::binary_search(node, node + n, probes[i & 4095], compare_pair_kv<key_type, key_type>()); }, expected);
+    double after = nanosPerLookup([&](int i) { return containsKey(pairs.pick(i), n, probes[i & 4095]); }, checksum);
+
+    std::cout << what << " " << type_name << " n=" << n << (num_nodes > 1 ? " cold" : " hot ") << ": std::binary_search " << before << " ns, "
+              << KeyCounter<key_type>::getName() << " " << after << " ns"
+              << (checksum == expected ? "" : "  MISMATCH") << std::endl;
+}
+
+// nearly consecutive keys, as in the sealed leaves of the sorted tree:
+// searchKeys over the whole leaf against interpolation followed by a search
+// of INTERPOLATION_ERROR keys on either side, as in leaves flagged by sealLeaf
+template <typename key_type>
+void benchDense(const char *type_name, const char *what, int n, int error, int num_nodes)
+{
+    std::mt19937_64 rng(n);
+    std::vector<key_type> sorted(n);
+    key_type key = 0;
+    for (int i = 0; i < n; i++)
+        sorted[i] = key += (key_type)(1 + rng() % 4);
+
+    int max_error = 0;
+    for (int i = 0; i < n; i++)
+        max_error = std::max(max_error, std::abs(interpolatePosition(sorted[0], sorted[n - 1], n, sorted[i]) - i));
+
+    NodeSet<key_type> keys(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        std::copy(sorted.begin(), sorted.end(), keys.node(i));
+
+    std::vector<key_type> probes(4096);
+    for (size_t i = 0; i < probes.size(); i++)
+        probes[i] = sorted[rng() % n];
+
+    long long checksum = 0, expected = 0;
+    double before = nanosPerLookup([&](int i) { return searchKeys(keys.pick(i), n, probes[i & 4095]); }, expected);
+    double after = nanosPerLookup([&](int i) {
+        const key_type *node = keys.pick(i);
+        key_type probe = probes[i & 4095];
+        int lo = std::max(0, interpolatePosition(node[0], node[n - 1], n, probe) - error);
+        return lo + searchKeys(node + lo, std::min(n - lo, 2 * error + 1), probe);
+    }, checksum);
+
+    std::cout << what << " " << type_name << " n=" << n << (num_nodes > 1 ? " cold" : " hot ") << ": " << KeyCounter<key_type>::getName() << " " << before
+              << " ns, interpolation " << after << " ns (error " << max_error << ")"
+              << (checksum == expected && max_error <= error ? "" : "  MISMATCH") << std::endl;
+}
+
+template <typename key_type>
+void benchType(const char *type_name, int num_nodes)
+{
+    typedef BeTree_Default_Knobs<key_type, key_type> knobs;
+    benchKeys<key_type>(type_name, "pivots ", knobs::NUM_PIVOTS, num_nodes);
+    benchPairs<key_type>(type_name, "leaf   ", knobs::NUM_DATA_PAIRS, num_nodes);
+    // leaves with LEAF_SPLIT are searched as a plain key array
+    benchKeys<key_type>(type_name, "leaf/kv", knobs::NUM_DATA_PAIRS, num_nodes);
+    // leaves with LEAF_FOR are searched as an array of 16-bit deltas
+    benchKeys<uint16_t>(type_name, "leaf/for", knobs::NUM_PACKED_DATA_PAIRS, num_nodes);
+    benchDense<key_type>(type_name, "leaf/dense", knobs::NUM_DATA_PAIRS, knobs::INTERPOLATION_ERROR, num_nodes);
+    if (knobs::NUM_UPSERTS > 1)
+        benchPairs<key_type>(type_name, "buffer ", knobs::NUM_UPSERTS, num_nodes);
+}
+
+int main()
+{
+    benchType<int>("int", 1);
+    benchType<long>("long", 1);
+    benchType<int>("int", BENCH_COLD_NODES);
+    benchType<long>("long", BENCH_COLD_NODES);
+    return 0;
+}
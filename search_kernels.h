@@ -0,0 +1,475 @@
+#ifndef SEARCH_KERNELS_H
+#define SEARCH_KERNELS_H
+
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE4_2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// the branch-free binary search stops once this many candidates are left;
+// the vector kernel then counts the smaller keys among them in one pass
+// (16 did best at the default node sizes, see search_bench.cpp)
+#define SEARCH_WINDOW 16
+
+// width in bits of the keys the vector kernels handle, 0 for key types that
+// are searched with scalar compares only (unsigned and floating point keys)
+template <typename key_type>
+struct SearchLanes
+{
+    static const int bits = 0;
+};
+
+// deltas of compressed leaves (LEAF_FOR)
+template <>
+struct SearchLanes<uint16_t>
+{
+    static const int bits = 16;
+};
+
+template <>
+struct SearchLanes<int>
+{
+    static const int bits = sizeof(int) == 4 ? 32 : 0;
+};
+
+template <>
+struct SearchLanes<long>
+{
+    static const int bits = sizeof(long) == 8 ? 64 : 0;
+};
+
+template <>
+struct SearchLanes<long long>
+{
+    static const int bits = sizeof(long long) == 8 ? 64 : 0;
+};
+
+/**
+ *  Counts the keys smaller than a search key among [n] sorted keys that are
+ *  [stride] key widths apart (1 for plain key arrays, 2 for arrays of
+ *  (key, value) pairs with a value as wide as the key). The kernel is picked
+ *  at compile time from the key width and the instruction sets the build
+ *  targets: AVX2, then SSE4.2 (64-bit keys) or SSE2 (32 and 16-bit keys), then
+ *  scalar compares.
+ */
+template <typename key_type, int bits = SearchLanes<key_type>::bits>
+struct KeyCounter
+{
+    static const char *getName() { return "scalar"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        int count = 0;
+        for (int i = 0; i < n; i++)
+            count += keys[i * stride] < key;
+        return count;
+    }
+};
+
+template <typename key_type>
+struct KeyCounter<key_type, 32>
+{
+    // every compare leaves -1 in the lanes holding smaller keys, which is
+    // subtracted from per-lane counts that are summed up at the end; with
+    // pairs only the even lanes hold keys
+#if defined(__AVX2__)
+    static const char *getName() { return "avx2"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        const int per_vector = 8 / stride;
+        __m256i lanes = stride == 1 ? _mm256_set1_epi32(-1) : _mm256_set1_epi64x(0xFFFFFFFF);
+        __m256i needle = _mm256_set1_epi32((int)key);
+        __m256i counts = _mm256_setzero_si256();
+
+        int i = 0;
+        for (; i + per_vector <= n; i += per_vector)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i * stride));
+            counts = _mm256_sub_epi32(counts, _mm256_and_si256(_mm256_cmpgt_epi32(needle, v), lanes));
+        }
+
+        int32_t sums[8];
+        _mm256_storeu_si256((__m256i *)sums, counts);
+        int count = sums[0] + sums[1] + sums[2] + sums[3] + sums[4] + sums[5] + sums[6] + sums[7];
+        for (; i < n; i++)
+            count += keys[i * stride] < key;
+        return count;
+    }
+#elif defined(__SSE2__)
+    static const char *getName() { return "sse2"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        const int per_vector = 4 / stride;
+        __m128i lanes = stride == 1 ? _mm_set1_epi32(-1) : _mm_set_epi32(0, -1, 0, -1);
+        __m128i needle = _mm_set1_epi32((int)key);
+        __m128i counts = _mm_setzero_si128();
+
+        int i = 0;
+        for (; i + per_vector <= n; i += per_vector)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(keys + i * stride));
+            counts = _mm_sub_epi32(counts, _mm_and_si128(_mm_cmpgt_epi32(needle, v), lanes));
+        }
+
+        int32_t sums[4];
+        _mm_storeu_si128((__m128i *)sums, counts);
+        int count = sums[0] + sums[1] + sums[2] + sums[3];
+        for (; i < n; i++)
+            count += keys[i * stride] < key;
+        return count;
+    }
+#else
+    static const char *getName() { return "scalar"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        return KeyCounter<key_type, 0>::countLess(keys, stride, n, key);
+    }
+#endif
+};
+
+template <typename key_type>
+struct KeyCounter<key_type, 16>
+{
+    // the deltas are unsigned, and x86 only compares signed 16-bit lanes:
+    // flipping the top bit of both sides keeps their order. A lane counts at
+    // most n / 8 keys, far below its limit for arrays of node size.
+#if defined(__AVX2__)
+    static const char *getName() { return "avx2"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        if (stride != 1)
+            return KeyCounter<key_type, 0>::countLess(keys, stride, n, key);
+
+        __m256i flip = _mm256_set1_epi16((short)0x8000);
+        __m256i needle = _mm256_xor_si256(_mm256_set1_epi16((short)key), flip);
+        __m256i counts = _mm256_setzero_si256();
+
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), flip);
+            counts = _mm256_sub_epi16(counts, _mm256_cmpgt_epi16(needle, v));
+        }
+
+        int16_t sums[16];
+        _mm256_storeu_si256((__m256i *)sums, counts);
+        int count = 0;
+        for (int l = 0; l < 16; l++)
+            count += sums[l];
+        for (; i < n; i++)
+            count += keys[i] < key;
+        return count;
+    }
+#elif defined(__SSE2__)
+    static const char *getName() { return "sse2"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        if (stride != 1)
+            return KeyCounter<key_type, 0>::countLess(keys, stride, n, key);
+
+        __m128i flip = _mm_set1_epi16((short)0x8000);
+        __m128i needle = _mm_xor_si128(_mm_set1_epi16((short)key), flip);
+        __m128i counts = _mm_setzero_si128();
+
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), flip);
+            counts = _mm_sub_epi16(counts, _mm_cmpgt_epi16(needle, v));
+        }
+
+        int16_t sums[8];
+        _mm_storeu_si128((__m128i *)sums, counts);
+        int count = 0;
+        for (int l = 0; l < 8; l++)
+            count += sums[l];
+        for (; i < n; i++)
+            count += keys[i] < key;
+        return count;
+    }
+#else
+    static const char *getName() { return "scalar"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        return KeyCounter<key_type, 0>::countLess(keys, stride, n, key);
+    }
+#endif
+};
+
+template <typename key_type>
+struct KeyCounter<key_type, 64>
+{
+#if defined(__AVX2__)
+    static const char *getName() { return "avx2"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        const int per_vector = 4 / stride;
+        __m256i lanes = stride == 1 ? _mm256_set1_epi64x(-1) : _mm256_set_epi64x(0, -1, 0, -1);
+        __m256i needle = _mm256_set1_epi64x((long long)key);
+        __m256i counts = _mm256_setzero_si256();
+
+        int i = 0;
+        for (; i + per_vector <= n; i += per_vector)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(keys + i * stride));
+            counts = _mm256_sub_epi64(counts, _mm256_and_si256(_mm256_cmpgt_epi64(needle, v), lanes));
+        }
+
+        int64_t sums[4];
+        _mm256_storeu_si256((__m256i *)sums, counts);
+        int count = (int)(sums[0] + sums[1] + sums[2] + sums[3]);
+        for (; i < n; i++)
+            count += keys[i * stride] < key;
+        return count;
+    }
+#elif defined(__SSE4_2__)
+    static const char *getName() { return "sse4.2"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        // a vector holds a single pair, so pairs are left to the scalar loop
+        if (stride != 1)
+            return KeyCounter<key_type, 0>::countLess(keys, stride, n, key);
+
+        __m128i needle = _mm_set1_epi64x((long long)key);
+        __m128i counts = _mm_setzero_si128();
+
+        int i = 0;
+        for (; i + 2 <= n; i += 2)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+            counts = _mm_sub_epi64(counts, _mm_cmpgt_epi64(needle, v));
+        }
+
+        int64_t sums[2];
+        _mm_storeu_si128((__m128i *)sums, counts);
+        int count = (int)(sums[0] + sums[1]);
+        for (; i < n; i++)
+            count += keys[i] < key;
+        return count;
+    }
+#else
+    static const char *getName() { return "scalar"; }
+
+    static int countLess(const key_type *keys, int stride, int n, const key_type &key)
+    {
+        return KeyCounter<key_type, 0>::countLess(keys, stride, n, key);
+    }
+#endif
+};
+
+/**
+ *  returns: index of the first of [n] sorted elements whose key is not
+ *  smaller than [key] (n if there is none), like std::lower_bound
+ *  Function: halves the range without branches until SEARCH_WINDOW
+ *  elements are left, then counts the smaller keys in the window with the
+ *  kernel of KeyCounter. [stride] is the distance between keys in key widths.
+ */
+template <typename key_type>
+int searchStrided(const key_type *keys, int stride, int n, const key_type &key)
+{
+    const key_type *base = keys;
+    while (n > SEARCH_WINDOW)
+    {
+        int half = n >> 1;
+        base = base[(half - 1) * stride] < key ? base + half * stride : base;
+        n -= half;
+    }
+    return (int)((base - keys) / stride) + KeyCounter<key_type>::countLess(base, stride, n, key);
+}
+
+// lower bound of [key] among [n] sorted keys
+template <typename key_type>
+int searchKeys(const key_type *keys, int n, const key_type &key)
+{
+    return searchStrided(keys, 1, n, key);
+}
+
+// lower bound of [key] among [n] (key, value) pairs sorted by key
+template <typename key_type, typename value_type>
+int searchPairs(const std::pair<key_type, value_type> *pairs, int n, const key_type &key)
+{
+    // pairs whose value is as wide as the key are searched as a strided key
+    // array; other layouts go through the pairs one compare at a time
+    if (sizeof(std::pair<key_type, value_type>) == 2 * sizeof(key_type))
+        return searchStrided(&pairs[0].first, 2, n, key);
+
+    int lo = 0, len = n;
+    while (len > 0)
+    {
+        int half = len >> 1;
+        if (pairs[lo + half].first < key)
+        {
+            lo += half + 1;
+            len -= half + 1;
+        }
+        else
+        {
+            len = half;
+        }
+    }
+    return lo;
+}
+
+// checks if one of [n] (key, value) pairs sorted by key has key [key]
+template <typename key_type, typename value_type>
+bool containsKey(const std::pair<key_type, value_type> *pairs, int n, const key_type &key)
+{
+    int pos = searchPairs(pairs, n, key);
+    return pos < n && !(key < pairs[pos].first);
+}
+
+// position of [key] among [n] sorted keys from [first] to [last] (which
+// differ) if they were spread evenly, by linear interpolation
+template <typename key_type>
+int interpolatePosition(const key_type &first, const key_type &last, int n, const key_type &key)
+{
+    return (int)(((double)key - (double)first) / ((double)last - (double)first) * (n - 1) + 0.5);
+}
+
+// Eytzinger layout: n sorted keys stored as an implicit binary search tree in
+// breadth-first order. Positions below are 1-based (the root is 1, the
+// children of k are 2k and 2k + 1); the array holds position k at index k - 1.
+// The first levels of the tree share cache lines, and the keys a search
+// reads next are at a predictable place, so they can be prefetched.
+
+// number of positions in the subtree under position [k] of a tree of [n] keys
+inline int eytzingerSubtree(int k, int n)
+{
+    if (k > n)
+        return 0;
+
+    // levels 0..t-1 below k are full, level t holds the rest
+    int t = (31 - __builtin_clz(n)) - (31 - __builtin_clz(k));
+    if (((long long)k << t) > n)
+        t--;
+    long long first = (long long)k << t;
+    return (1 << t) - 1 + (int)std::min((long long)n - first + 1, 1LL << t);
+}
+
+// rank in sorted order of the key at position [k]
+inline int eytzingerRank(int k, int n)
+{
+    // rank in the perfect tree with the same number of levels, whose last
+    // level is full: k is at depth d of a tree of height h
+    int d = 31 - __builtin_clz(k);
+    int h = 31 - __builtin_clz(n);
+    int rank = ((2 * (k - (1 << d)) + 1) << (h - d)) - 1;
+
+    // the perfect tree's last level has its positions at the even ranks;
+    // the ones past the last_level positions present in this tree are
+    // missing, and those before k do not count
+    int last_level = n - (1 << h) + 1;
+    if (rank >= 2 * last_level)
+        rank -= (rank - 2 * last_level + 1) >> 1;
+    return rank;
+}
+
+// array index of the key of rank [rank]
+inline int eytzingerIndex(int rank, int n)
+{
+    int k = 1;
+    while (true)
+    {
+        int left = eytzingerSubtree(2 * k, n);
+        if (rank == left)
+            return k - 1;
+        if (rank < left)
+        {
+            k = 2 * k;
+        }
+        else
+        {
+            rank -= left + 1;
+            k = 2 * k + 1;
+        }
+    }
+}
+
+// lays out [n] sorted keys in Eytzinger order; [sorted] and [eytzinger]
+// must not overlap
+template <typename key_type>
+void toEytzinger(const key_type *sorted, key_type *eytzinger, int n)
+{
+    // in-order walk of the implicit tree, starting at its leftmost position
+    int k = 1;
+    while (2 * k <= n)
+        k = 2 * k;
+    for (int rank = 0; rank < n; rank++)
+    {
+        eytzinger[k - 1] = sorted[rank];
+        if (2 * k + 1 <= n)
+        {
+            k = 2 * k + 1;
+            while (2 * k <= n)
+                k = 2 * k;
+        }
+        else
+        {
+            while (k & 1)
+                k >>= 1;
+            k >>= 1;
+        }
+    }
+}
+
+// inverse of toEytzinger
+template <typename key_type>
+void fromEytzinger(const key_type *eytzinger, key_type *sorted, int n)
+{
+    int k = 1;
+    while (2 * k <= n)
+        k = 2 * k;
+    for (int rank = 0; rank < n; rank++)
+    {
+        sorted[rank] = eytzinger[k - 1];
+        if (2 * k + 1 <= n)
+        {
+            k = 2 * k + 1;
+            while (2 * k <= n)
+                k = 2 * k;
+        }
+        else
+        {
+            while (k & 1)
+                k >>= 1;
+            k >>= 1;
+        }
+    }
+}
+
+/**
+ *  returns: rank of the first of [n] keys in Eytzinger order that is not
+ *  smaller than [key] (n if there is none), like searchKeys on sorted keys
+ *  Function: descends the implicit tree without branches, prefetching the
+ *  cache line of the descendants a few levels down (all of which are in
+ *  one line), then turns the position found into a rank.
+ */
+template <typename key_type>
+int searchEytzinger(const key_type *eytzinger, int n, const key_type &key)
+{
+    const int per_line = 64 / sizeof(key_type) > 0 ? 64 / sizeof(key_type) : 1;
+
+    int k = 1;
+    while (k <= n)
+    {
+        __builtin_prefetch(eytzinger + (long)per_line * k - 1);
+        k = 2 * k + (eytzinger[k - 1] < key);
+    }
+
+    // undo the right turns taken after the last left turn
+    k >>= __builtin_ffs(~k);
+    return k == 0 ? n : eytzingerRank(k, n);
+}
+
+#endif
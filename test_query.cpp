@@ -43,10 +43,11 @@ std::vector<int> generatePeriodicQuery(std::vector<int> data)
     return queries;
 }
 
-void dual_tree_test_query(const std::vector<int>& data_set)
+void dual_tree_test_query(const std::vector<int>& data_set, CachePolicy policy)
 {
     auto start = std::chrono::high_resolution_clock::now();
     dual_tree<int, int> dt;
+    dt.set_cache_policy(policy);
     int idx = 0;
     for(int i: data_set)
     {
@@ -103,16 +104,16 @@ void dual_tree_test_query(const std::vector<int>& data_set)
     std::cout << "Dual B+ Tree found " << counter << " out of " << p_queries.size() << std::endl;
 
     // query the dual tree in parallel
-    // counter = 0;
-    // start = std::chrono::high_resolution_clock::now();
-    // for (int i : queries) 
-    // {
-    //     counter += dt.parallelQuery(i);
-    // }
-    // stop = std::chrono::high_resolution_clock::now();
-    // duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-    // std::cout << "Prallel query time for dual tree(us):" << duration.count() << std::endl;
-    // std::cout << "Dual B+ Tree with Parallel read found " << counter << " out of " << data_set.size() << std::endl;
+    counter = 0;
+    start = std::chrono::high_resolution_clock::now();
+    for (int i : queries) 
+    {
+        counter += dt.parallelQuery(i);
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+    std::cout << "Prallel query time for dual tree(us):" << duration.count() << std::endl;
+    std::cout << "Dual B+ Tree with Parallel read found " << counter << " out of " << queries.size() << std::endl;
 
 
     // query the dual tree using MRU
@@ -149,16 +150,18 @@ void dual_tree_test_query(const std::vector<int>& data_set)
     duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
     std::cout << "MRU query with Periodic Workload Performance for dual tree(us):" << duration.count() << std::endl;
     std::cout << "Dual B+ Tree with MRU read found " << counter << " out of " << p_queries.size() << std::endl;
+    dt.print_cache_stats();
     std::cout << "--------------------------------------------------------------------------" << std::endl;
     
 }
 
-void b_plus_tree_test_query(const std::vector<int>& data_set)
+void b_plus_tree_test_query(const std::vector<int>& data_set, CachePolicy policy)
 {
 
     auto start = std::chrono::high_resolution_clock::now();
-    BeTree<int,int> tree("manager", "./tree_dat", BeTree_Default_Knobs<int, int>::BLOCK_SIZE,
+    BeTree<int,int> tree("manager", "./tree_dat", BeTree_Default_Knobs<int, int>::TREE_BLOCK_SIZE,
         BeTree_Default_Knobs<int, int>::BLOCKS_IN_MEMORY);
+    tree.setCachePolicy(policy);
 
     int idx = 0;
     for(int i: data_set)
@@ -209,6 +212,7 @@ void b_plus_tree_test_query(const std::vector<int>& data_set)
     duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
     std::cout << "B+ Tree query with Periodic Workload Performance:" << duration.count() << std::endl;
     std::cout << "B+ Tree found " << counter << " out of " << p_queries.size() << std::endl;
+    dual_tree<int, int>::print_tree_cache_stats("B+ Tree", &tree);
     std::cout << "--------------------------------------------------------------------------" << std::endl;
 
 }
@@ -220,7 +224,7 @@ void simple_test_query()
     dt.insert(20, 20);
 
     std::cout << dt.query(10) << std::endl;
-    // std::cout << dt.parallelQuery(10) << std::endl;
+    std::cout << dt.parallelQuery(10) << std::endl;
     std::cout << dt.MRU_query(10) << std::endl;
     std::cout << dt.MRU_query(12) << std::endl;
 }
@@ -229,7 +233,16 @@ int main(int argc, char **argv)
 {
     if(argc < 2)
     {
-        std::cout<< "Usage: ./main <input_file>" << std::endl;
+        std::cout<< "Usage: ./main <input_file> [lru|2q|clock]" << std::endl;
+        return 1;
+    }
+
+    // replacement policy of the buffer pools
+    CachePolicy policy = BeTree_Default_Knobs<int, int>::CACHE_POLICY;
+    if(argc > 2 && !parseCachePolicy(argv[2], policy))
+    {
+        std::cout << "Unknown cache policy " << argv[2] << std::endl;
+        return 1;
     }
 
     // Read the input file
@@ -247,8 +260,8 @@ int main(int argc, char **argv)
 
     dual_tree<int, int>::show_tree_knobs();
     
-    dual_tree_test_query(data);
-    b_plus_tree_test_query(data);
+    dual_tree_test_query(data, policy);
+    b_plus_tree_test_query(data, policy);
 
     // simple_test_query();
 
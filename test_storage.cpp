@@ -0,0 +1,213 @@
+#include <iostream>
+#include <random>
+#include <sys/stat.h>
+#include "betree.h"
+#include "dual_tree.h"
+
+// default knobs with a warm-up snapshot saved on every flush
+template <typename _Key, typename _Value>
+class Snapshot_Knobs : public BeTree_Default_Knobs<_Key, _Value>
+{
+public:
+    static const bool WARM_UP_SNAPSHOT = true;
+};
+
+typedef BeTree<int, int, Snapshot_Knobs<int, int>> SnapshotTree;
+
+// the same tree without the snapshot
+typedef BeTree<int, int, BeTree_Default_Knobs<int, int>> ColdTree;
+
+static const char *TEST_DIR = "./tree_dat";
+
+static const uint TEST_CACHE_BLOCKS = 64;
+
+int failures = 0;
+
+void check(bool ok, const std::string &what)
+{
+    std::cout << (ok ? "passed: " : "FAILED: ") << what << std::endl;
+    if (!ok)
+        failures++;
+}
+
+std::vector<int> shuffledKeys(int n)
+{
+    std::vector<int> keys;
+    for (int i = 0; i < n; i++)
+        keys.push_back(i);
+    std::mt19937 generator(42);
+    std::shuffle(keys.begin(), keys.end(), generator);
+    return keys;
+}
+
+template <typename Tree>
+int countFound(Tree &tree, int from, int to)
+{
+    int found = 0;
+    for (int k = from; k < to; k++)
+        found += tree.query(k);
+    return found;
+}
+
+// A tree is closed after its hot keys were queried and opened again. Its
+// blocks are still there, and as it warms up from the snapshot on opening
+// the hot keys are found without a single miss.
+void reopen_test()
+{
+    const int n = 50000, hot = 2000;
+    uint num_blocks, resident;
+    {
+        SnapshotTree tree("storage_reopen", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+        std::vector<int> keys = shuffledKeys(n);
+        for (size_t i = 0; i < keys.size(); i++)
+            tree.insert(keys[i], keys[i]);
+        countFound(tree, 0, hot);
+        num_blocks = tree.getNumBlocks();
+        tree.flush();
+        resident = tree.getResidentBlocks();
+    }
+
+    {
+        SnapshotTree tree("storage_reopen", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS, 0.5, nullptr, true);
+        check(tree.getNumBlocks() == num_blocks, "reopened tree keeps its blocks");
+
+        uint warmed = tree.getResidentBlocks();
+        check(warmed == resident, "opening the tree reads the blocks of its snapshot");
+
+        // opening the root and the leaves the tree keeps track of counts too
+        unsigned long long hits = tree.getLeafCacheHits() + tree.getInternalCacheHits();
+        unsigned long long misses = tree.getLeafCacheMisses() + tree.getInternalCacheMisses();
+        int found = countFound(tree, 0, hot);
+        hits = tree.getLeafCacheHits() + tree.getInternalCacheHits() - hits;
+        misses = tree.getLeafCacheMisses() + tree.getInternalCacheMisses() - misses;
+        std::cout << "Reopened tree: warmed up " << warmed << " blocks, hot keys found " << found << " out of " << hot
+                  << ", hits / misses = " << hits << " / " << misses << std::endl;
+        check(found == hot, "hot keys are found after reopening");
+        check(misses == 0, "hot keys are served from the warmed-up cache");
+
+        check(countFound(tree, 0, n) == n, "all keys are found after reopening");
+    }
+
+    {
+        // without the warm-up, the same queries miss
+        ColdTree tree("storage_reopen", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS, 0.5, nullptr, true);
+        countFound(tree, 0, hot);
+        check(tree.getLeafCacheMisses() > 0, "a cold reopened tree misses on the hot keys");
+    }
+
+    {
+        // a tree that is not reopened starts empty
+        SnapshotTree tree("storage_reopen", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+        check(countFound(tree, 0, hot) == 0, "a new tree truncates the old file");
+    }
+}
+
+// Removing keys merges nodes and frees their blocks, and the keys inserted
+// next go to the freed blocks instead of new ones. The free list is kept
+// when the tree is reopened.
+void free_list_test()
+{
+    const int n = 50000;
+    uint num_blocks, num_free;
+    {
+        SnapshotTree tree("storage_free", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+        std::vector<int> keys = shuffledKeys(n);
+        for (size_t i = 0; i < keys.size(); i++)
+            tree.insert(keys[i], keys[i]);
+        num_blocks = tree.getNumBlocks();
+
+        int removed = 0;
+        for (int k = 0; k < n / 2; k++)
+            removed += tree.remove(k);
+        check(removed == n / 2 && !tree.remove(0), "every key is removed once");
+        check(countFound(tree, 0, n / 2) == 0 && countFound(tree, n / 2, n) == n / 2, "only the removed keys are gone");
+
+        uint freed = tree.getNumFreeBlocks();
+        std::cout << "Removing half of " << num_blocks << " blocks worth of keys freed " << freed << " blocks" << std::endl;
+        check(freed > 0, "merged nodes free their blocks");
+
+        for (int k = 0; k < n / 4; k++)
+            tree.insert(k, k);
+        check(tree.getNumBlocks() == num_blocks && tree.getNumFreeBlocks() < freed, "inserts reuse the freed blocks");
+        check(countFound(tree, 0, n / 4) == n / 4 && countFound(tree, n / 4, n / 2) == 0 && countFound(tree, n / 2, n) == n / 2,
+              "keys are found in the reused blocks");
+        num_free = tree.getNumFreeBlocks();
+        tree.flush();
+    }
+
+    SnapshotTree tree("storage_free", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS, 0.5, nullptr, true);
+    check(tree.getNumFreeBlocks() == num_free, "reopened tree keeps its free list");
+    check(countFound(tree, 0, n / 4) == n / 4 && countFound(tree, n / 2, n) == n / 2, "keys are found after reopening");
+}
+
+// The blocks of the keys inserted last are at the end of the file, and once
+// they are removed compacting gives their space back.
+void compact_test()
+{
+    const int n = 50000;
+    SnapshotTree tree("storage_compact", TEST_DIR, Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, TEST_CACHE_BLOCKS);
+    for (int k = 0; k < n; k++)
+        tree.insert(k, k);
+    for (int k = n - 1; k >= n / 2; k--)
+        tree.remove(k);
+    tree.flush();
+
+    uint num_blocks = tree.getNumBlocks();
+    uint shrunk = tree.compact();
+    struct stat st;
+    stat((std::string(TEST_DIR) + "/storage_compact").c_str(), &st);
+    std::cout << "Compacting shrank the file from " << num_blocks << " to " << tree.getNumBlocks() << " blocks" << std::endl;
+    check(shrunk > 0 && tree.getNumBlocks() == num_blocks - shrunk, "compacting drops the free blocks at the end");
+    check(st.st_size == (off_t)tree.getNumBlocks() * Snapshot_Knobs<int, int>::TREE_BLOCK_SIZE, "compacting shrinks the file");
+    check(countFound(tree, 0, n / 2) == n / 2 && countFound(tree, n / 2, n) == 0, "keys are found after compacting");
+
+    for (int k = n / 2; k < n; k++)
+        tree.insert(k, k);
+    check(countFound(tree, 0, n) == n, "the tree grows again after compacting");
+}
+
+// The dual tree comes back with the tuples of both trees and of its heap buffer.
+void dual_tree_reopen_test()
+{
+    const int n = 100000;
+    std::vector<int> keys;
+    std::mt19937 generator(7);
+    for (int i = 0; i < n; i++)
+        keys.push_back(generator() % 20 == 0 ? (int)(generator() % n) : i);
+
+    uint sorted_size, unsorted_size;
+    {
+        dual_tree<int, int> dt(TEST_DIR);
+        for (size_t i = 0; i < keys.size(); i++)
+            dt.insert(keys[i], i);
+        sorted_size = dt.sorted_tree_size();
+        unsorted_size = dt.unsorted_tree_size();
+        dt.flush();
+    }
+
+    dual_tree<int, int> dt(TEST_DIR, "", "", true);
+    check(dt.sorted_tree_size() == sorted_size && dt.unsorted_tree_size() == unsorted_size,
+          "reopened dual tree keeps the sizes of its trees");
+
+    int found = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+        found += dt.query(keys[i]);
+    std::cout << "Reopened dual tree found " << found << " out of " << keys.size() << std::endl;
+    check(found == n, "all keys are found in the reopened dual tree");
+}
+
+int main()
+{
+    reopen_test();
+    free_list_test();
+    compact_test();
+    dual_tree_reopen_test();
+
+    if (failures > 0)
+    {
+        std::cout << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}